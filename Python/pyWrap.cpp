@@ -326,7 +326,9 @@ PYBIND11_MODULE(VIENNAPS_MODULE_NAME, module) {
              return std::nullopt;
            })
       .def("generateCellSet", &psDomain<T, D>::generateCellSet,
-           "Generate the cell set.")
+           pybind11::arg("depth") = 0.,
+           pybind11::arg("cellSetPosition") = false,
+           pybind11::arg("narrowBandWidth") = 0., "Generate the cell set.")
       .def("getCellSet", &psDomain<T, D>::getCellSet, "Get the cell set.")
       .def("printSurface", &psDomain<T, D>::printSurface,
            pybind11::arg("filename"), pybind11::arg("addMaterialIds") = false,
@@ -8,7 +8,7 @@ template <class T, int D> class csBVH {
 private:
   using BVPtrType = lsSmartPointer<csBoundingVolume<T, D>>;
   using BoundsType = csPair<std::array<T, D>>;
-  using CellIdsPtr = std::set<unsigned> *;
+  using CellIdsPtr = std::set<csIndexType> *;
 
   unsigned numLayers = 1;
   BVPtrType BV = nullptr;
@@ -31,5 +31,13 @@ public:
 
   void clearCellIds() { BV->clear(); }
 
+  // Renumber the stored cell ids after cells were removed from the cell set.
+  // Ids which are mapped to -1 are removed.
+  void remapCellIds(const std::vector<csIndexType> &newIndices) {
+#pragma omp parallel
+#pragma omp single
+    BV->remapCellIds(newIndices);
+  }
+
   size_t getTotalCellCount() { return BV->getTotalCellCounts(); }
 };
\ No newline at end of file
@@ -10,10 +10,10 @@ template <class T, int D> class csBoundingVolume {
 private:
   using BVPtrType = lsSmartPointer<csBoundingVolume<T, D>>;
   using BoundsType = csPair<std::array<T, D>>;
-  using CellIdsPtr = std::set<unsigned> *;
+  using CellIdsPtr = std::set<csIndexType> *;
 
   static constexpr int numCells = 1 << D;
-  std::array<std::set<unsigned>, numCells> cellIds;
+  std::array<std::set<csIndexType>, numCells> cellIds;
   std::array<BoundsType, numCells> bounds;
   std::array<BVPtrType, numCells> links;
   int layer = -1;
@@ -88,6 +88,26 @@ public:
     }
   }
 
+  void remapCellIds(const std::vector<csIndexType> &newIndices) {
+    if (layer == 0) {
+      for (size_t i = 0; i < numCells; i++) {
+        // the mapping preserves the order, so the ids can be appended
+        std::set<csIndexType> remapped;
+        for (const auto id : cellIds[i]) {
+          if (newIndices[id] >= 0)
+            remapped.insert(remapped.end(), newIndices[id]);
+        }
+        cellIds[i].swap(remapped);
+      }
+    } else {
+      for (size_t i = 0; i < numCells; i++) {
+#pragma omp task
+        links[i]->remapCellIds(newIndices);
+      }
+#pragma omp taskwait
+    }
+  }
+
   BVPtrType getLink(const std::array<T, 3> &point) {
     auto vid = getVolumeIndex(point);
     return getLink(vid);
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <psLogger.hpp>
+
+/// File-backed storage for scalar cell data which does not have to stay in
+/// memory. Each field is split into bricks of a fixed number of consecutive
+/// cells, which are stored in a scratch file. Only a fixed number of bricks is
+/// kept in memory, the least recently used brick is written back to the file
+/// when another brick has to be loaded. The cells of a cell set are ordered by
+/// their position, so each brick is a slab of the domain and passes over the
+/// cells in their order only load each brick once. The access functions are
+/// thread-safe, but forEachBrick is much faster for passes over all cells.
+template <class T> class csBrickStore {
+  struct Field {
+    std::string label;
+    size_t size;
+    size_t firstSlot; // position of the first brick in the file
+    size_t numSlots;
+  };
+
+  struct Brick {
+    size_t slot;
+    bool dirty;
+    std::vector<T> values;
+  };
+
+  std::string fileName;
+  std::fstream file;
+  const size_t brickSize;
+  const size_t maxCachedBricks;
+
+  std::vector<Field> fields;
+  std::vector<std::pair<size_t, size_t>> freeSlots; // first slot, number
+  size_t numSlots = 0;
+
+  std::list<Brick> cache; // most recently used first
+  std::unordered_map<size_t, typename std::list<Brick>::iterator> cachedSlots;
+  std::mutex cacheMutex;
+
+public:
+  csBrickStore(const std::string &passedFileName,
+               const size_t passedBrickSize = 1 << 16,
+               const size_t passedMaxCachedBricks = 64)
+      : fileName(passedFileName),
+        brickSize(std::max<size_t>(passedBrickSize, 1)),
+        maxCachedBricks(std::max<size_t>(passedMaxCachedBricks, 1)) {
+    file.open(fileName, std::ios::in | std::ios::out | std::ios::binary |
+                            std::ios::trunc);
+    if (!file.is_open()) {
+      psLogger::getInstance()
+          .addWarning("Could not open scratch file " + fileName)
+          .print();
+    }
+  }
+
+  ~csBrickStore() {
+    file.close();
+    std::remove(fileName.c_str());
+  }
+
+  csBrickStore(const csBrickStore &) = delete;
+  void operator=(const csBrickStore &) = delete;
+
+  // Returns the id of the field with the given label, or -1.
+  int getFieldId(const std::string &label) const {
+    for (unsigned i = 0; i < fields.size(); ++i) {
+      if (fields[i].label == label && fields[i].numSlots > 0)
+        return i;
+    }
+    return -1;
+  }
+
+  bool hasField(const std::string &label) const {
+    return getFieldId(label) >= 0;
+  }
+
+  size_t getBrickSize() const { return brickSize; }
+
+  // Stores the values as a new field and returns its id. A field with the
+  // same label is replaced.
+  int insertField(const std::string &label, const std::vector<T> &values) {
+    removeField(label);
+    std::lock_guard<std::mutex> lock(cacheMutex);
+
+    Field field{label, values.size(), 0,
+                (values.size() + brickSize - 1) / brickSize};
+    field.firstSlot = allocateSlots(field.numSlots);
+    for (size_t b = 0; b < field.numSlots; ++b) {
+      const size_t begin = b * brickSize;
+      const size_t count = std::min(brickSize, values.size() - begin);
+      writeSlot(field.firstSlot + b, values.data() + begin, count);
+    }
+
+    for (unsigned i = 0; i < fields.size(); ++i) {
+      if (fields[i].numSlots == 0) {
+        fields[i] = field;
+        return i;
+      }
+    }
+    fields.push_back(field);
+    return fields.size() - 1;
+  }
+
+  // Copies all values of a field to the vector.
+  void readField(const std::string &label, std::vector<T> &values) {
+    const int fieldId = getFieldId(label);
+    if (fieldId < 0)
+      return;
+    values.resize(fields[fieldId].size);
+    visitBricks(
+        fieldId,
+        [&values](size_t begin, T *brick, size_t count) {
+          std::copy(brick, brick + count, values.begin() + begin);
+        },
+        false);
+  }
+
+  void removeField(const std::string &label) {
+    const int fieldId = getFieldId(label);
+    if (fieldId < 0)
+      return;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto &field = fields[fieldId];
+    for (size_t b = 0; b < field.numSlots; ++b) {
+      auto it = cachedSlots.find(field.firstSlot + b);
+      if (it != cachedSlots.end()) {
+        cache.erase(it->second);
+        cachedSlots.erase(it);
+      }
+    }
+    freeSlots.emplace_back(field.firstSlot, field.numSlots);
+    field.numSlots = 0;
+  }
+
+  // Removes all fields and truncates the scratch file.
+  void clear() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    fields.clear();
+    freeSlots.clear();
+    cache.clear();
+    cachedSlots.clear();
+    numSlots = 0;
+    file.close();
+    file.open(fileName, std::ios::in | std::ios::out | std::ios::binary |
+                            std::ios::trunc);
+  }
+
+  T get(const int fieldId, const size_t cellIdx) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return getBrick(fieldId, cellIdx / brickSize)
+        .values[cellIdx % brickSize];
+  }
+
+  void set(const int fieldId, const size_t cellIdx, const T value) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto &brick = getBrick(fieldId, cellIdx / brickSize);
+    brick.values[cellIdx % brickSize] = value;
+    brick.dirty = true;
+  }
+
+  void add(const int fieldId, const size_t cellIdx, const T value) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto &brick = getBrick(fieldId, cellIdx / brickSize);
+    brick.values[cellIdx % brickSize] += value;
+    brick.dirty = true;
+  }
+
+  // Calls function(firstCell, values, count) for each brick of the field in
+  // the order of the cells. The values can be modified.
+  template <class BrickFunction>
+  void forEachBrick(const int fieldId, BrickFunction function) {
+    visitBricks(fieldId, function, true);
+  }
+
+  // Removes cells from all fields. newIndices maps each cell to its new
+  // index, or to -1 if the cell is removed. The order of the remaining cells
+  // has to be preserved, so that the fields can be compacted in place.
+  template <class IndexType>
+  void compact(const std::vector<IndexType> &newIndices,
+               const size_t newSize) {
+    std::vector<T> buffer(brickSize);
+    for (unsigned fieldId = 0; fieldId < fields.size(); ++fieldId) {
+      if (fields[fieldId].numSlots == 0)
+        continue;
+      std::lock_guard<std::mutex> lock(cacheMutex);
+      const size_t size = fields[fieldId].size;
+      for (size_t b = 0; b * brickSize < size; ++b) {
+        const size_t begin = b * brickSize;
+        const size_t count = std::min(brickSize, size - begin);
+        auto &values = getBrick(fieldId, b).values;
+        std::copy(values.begin(), values.begin() + count, buffer.begin());
+
+        // new indices are never larger than the old ones, so only bricks
+        // which were already read are written
+        Brick *target = nullptr;
+        size_t targetBrick = 0;
+        for (size_t i = 0; i < count; ++i) {
+          if (newIndices[begin + i] < 0)
+            continue;
+          const size_t newIdx = newIndices[begin + i];
+          if (target == nullptr || newIdx / brickSize != targetBrick) {
+            targetBrick = newIdx / brickSize;
+            target = &getBrick(fieldId, targetBrick);
+            target->dirty = true;
+          }
+          target->values[newIdx % brickSize] = buffer[i];
+        }
+      }
+      fields[fieldId].size = newSize;
+    }
+  }
+
+  // Write all modified bricks to the scratch file.
+  void flush() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    for (auto &brick : cache) {
+      if (brick.dirty) {
+        writeSlot(brick.slot, brick.values.data(), brickSize);
+        brick.dirty = false;
+      }
+    }
+    file.flush();
+  }
+
+private:
+  template <class BrickFunction>
+  void visitBricks(const int fieldId, BrickFunction function,
+                   const bool modify) {
+    const size_t size = fields[fieldId].size;
+    for (size_t begin = 0; begin < size; begin += brickSize) {
+      std::lock_guard<std::mutex> lock(cacheMutex);
+      auto &brick = getBrick(fieldId, begin / brickSize);
+      function(begin, brick.values.data(), std::min(brickSize, size - begin));
+      brick.dirty = brick.dirty || modify;
+    }
+  }
+
+  size_t allocateSlots(const size_t count) {
+    for (auto it = freeSlots.begin(); it != freeSlots.end(); ++it) {
+      if (it->second >= count) {
+        const size_t first = it->first;
+        it->first += count;
+        it->second -= count;
+        if (it->second == 0)
+          freeSlots.erase(it);
+        return first;
+      }
+    }
+    const size_t first = numSlots;
+    numSlots += count;
+    return first;
+  }
+
+  // Returns the brick from the cache or loads it from the file. The cache
+  // mutex has to be held.
+  Brick &getBrick(const int fieldId, const size_t brickIdx) {
+    const size_t slot = fields[fieldId].firstSlot + brickIdx;
+    auto it = cachedSlots.find(slot);
+    if (it != cachedSlots.end()) {
+      cache.splice(cache.begin(), cache, it->second);
+      return cache.front();
+    }
+
+    std::vector<T> values;
+    if (cache.size() >= maxCachedBricks) {
+      auto &last = cache.back();
+      if (last.dirty)
+        writeSlot(last.slot, last.values.data(), brickSize);
+      cachedSlots.erase(last.slot);
+      values.swap(last.values);
+      cache.pop_back();
+    }
+    values.resize(brickSize);
+    readSlot(slot, values.data());
+
+    cache.push_front(Brick{slot, false, std::move(values)});
+    cachedSlots[slot] = cache.begin();
+    return cache.front();
+  }
+
+  void writeSlot(const size_t slot, const T *values, const size_t count) {
+    file.seekp(slot * brickSize * sizeof(T));
+    file.write(reinterpret_cast<const char *>(values), count * sizeof(T));
+    // bricks are always stored with their full size
+    if (count < brickSize) {
+      std::vector<T> padding(brickSize - count, T(0));
+      file.write(reinterpret_cast<const char *>(padding.data()),
+                 padding.size() * sizeof(T));
+    }
+    if (!file) {
+      psLogger::getInstance()
+          .addError("Could not write to scratch file " + fileName)
+          .print();
+    }
+  }
+
+  void readSlot(const size_t slot, T *values) {
+    file.seekg(slot * brickSize * sizeof(T));
+    file.read(reinterpret_cast<char *>(values), brickSize * sizeof(T));
+    if (!file) {
+      psLogger::getInstance()
+          .addError("Could not read from scratch file " + fileName)
+          .print();
+    }
+  }
+};
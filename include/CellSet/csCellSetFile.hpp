@@ -0,0 +1,289 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CS_CELL_SET_FILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <psLogger.hpp>
+
+/// Binary file format for the scalar data of a cell set. All values are
+/// stored little-endian. The file starts with a header:
+///
+///   char[8]  magic "CSCELLS\0"
+///   uint32   format version
+///   uint32   dimension
+///   uint32   size of a value in bytes (4 or 8)
+///   uint32   number of scalar data fields
+///   uint64   number of cells
+///   uint64   offset of the first column from the start of the file
+///   float64  grid delta
+///   float64  depth of the cell set
+///   per field: uint32 label length, label characters
+///
+/// The columns follow at the data offset, one per scalar data field in the
+/// order of the labels. Each column starts at a multiple of 64 bytes, so the
+/// file can be memory mapped and the columns be used directly.
+template <class T> class csCellSetFile {
+  static constexpr char magic[8] = {'C', 'S', 'C', 'E', 'L', 'L', 'S', '\0'};
+  static constexpr uint32_t version = 1;
+  static constexpr size_t alignment = 64;
+
+public:
+  uint32_t dimension = 0;
+  uint64_t numberOfCells = 0;
+  double gridDelta = 0.;
+  double depth = 0.;
+  std::vector<std::string> labels;
+
+  // Returns whether the file starts with the magic bytes of the format.
+  static bool isBinaryFile(const std::string &fileName) {
+    std::ifstream file(fileName, std::ios::binary);
+    char fileMagic[sizeof(magic)] = {};
+    file.read(fileMagic, sizeof(magic));
+    return file && std::memcmp(fileMagic, magic, sizeof(magic)) == 0;
+  }
+
+  // Write the header and one column per label. columns[i] has to hold
+  // numberOfCells values.
+  bool write(const std::string &fileName,
+             const std::vector<const std::vector<T> *> &columns) const {
+    std::ofstream file(fileName, std::ios::binary);
+    if (!file.is_open()) {
+      psLogger::getInstance()
+          .addWarning("Could not open file " + fileName)
+          .print();
+      return false;
+    }
+
+    std::vector<char> header(magic, magic + sizeof(magic));
+    append<uint32_t>(header, version);
+    append<uint32_t>(header, dimension);
+    append<uint32_t>(header, sizeof(T));
+    append<uint32_t>(header, labels.size());
+    append<uint64_t>(header, numberOfCells);
+    append<uint64_t>(header, getDataOffset());
+    append<double>(header, gridDelta);
+    append<double>(header, depth);
+    for (const auto &label : labels) {
+      append<uint32_t>(header, label.size());
+      header.insert(header.end(), label.begin(), label.end());
+    }
+    header.resize(getDataOffset(), 0);
+    file.write(header.data(), header.size());
+
+    const auto columnSize = numberOfCells * sizeof(T);
+    std::vector<char> padding(getColumnStride() - columnSize, 0);
+    std::vector<T> swapped;
+    for (const auto column : columns) {
+      const T *values = column->data();
+      if (!isLittleEndian()) {
+        swapped = *column;
+        for (auto &value : swapped)
+          swapBytes(value);
+        values = swapped.data();
+      }
+      file.write(reinterpret_cast<const char *>(values), columnSize);
+      file.write(padding.data(), padding.size());
+    }
+
+    return file.good();
+  }
+
+  // Read the header and all columns. getColumn(label) has to return the
+  // vector to read the column into, or nullptr to skip it. The file is memory
+  // mapped where possible.
+  template <class ColumnFunction>
+  bool read(const std::string &fileName, ColumnFunction getColumn) {
+#ifdef CS_CELL_SET_FILE_MMAP
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+      return openError(fileName);
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+      close(fd);
+      return openError(fileName);
+    }
+    const size_t fileSize = fileStat.st_size;
+    void *mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+      return openError(fileName);
+    madvise(mapped, fileSize, MADV_SEQUENTIAL);
+
+    const char *begin = static_cast<const char *>(mapped);
+    auto readBytes = [begin, fileSize](size_t offset, void *dest,
+                                       size_t size) {
+      if (offset > fileSize || size > fileSize - offset)
+        return false;
+      std::memcpy(dest, begin + offset, size);
+      return true;
+    };
+    const bool success = readContent(readBytes, fileSize, getColumn);
+    munmap(mapped, fileSize);
+#else
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+      return openError(fileName);
+    const size_t fileSize = static_cast<size_t>(file.tellg());
+    auto readBytes = [&file](size_t offset, void *dest, size_t size) {
+      file.seekg(offset);
+      file.read(static_cast<char *>(dest), size);
+      return bool(file);
+    };
+    const bool success = readContent(readBytes, fileSize, getColumn);
+#endif
+    if (!success) {
+      psLogger::getInstance()
+          .addWarning("Invalid cell set file " + fileName)
+          .print();
+    }
+    return success;
+  }
+
+private:
+  // The size of the file is checked before any column is passed to
+  // getColumn, so the columns are unchanged if the file is invalid.
+  template <class ReadFunction, class ColumnFunction>
+  bool readContent(ReadFunction readBytes, const size_t fileSize,
+                   ColumnFunction getColumn) {
+    char fileMagic[sizeof(magic)];
+    if (!readBytes(0, fileMagic, sizeof(magic)) ||
+        std::memcmp(fileMagic, magic, sizeof(magic)) != 0)
+      return false;
+
+    size_t offset = sizeof(magic);
+    uint32_t fileVersion = 0, valueSize = 0, numLabels = 0;
+    uint64_t dataOffset = 0;
+    if (!(get(readBytes, offset, fileVersion) && fileVersion == version &&
+          get(readBytes, offset, dimension) &&
+          get(readBytes, offset, valueSize) &&
+          (valueSize == sizeof(float) || valueSize == sizeof(double)) &&
+          get(readBytes, offset, numLabels) &&
+          get(readBytes, offset, numberOfCells) &&
+          get(readBytes, offset, dataOffset) &&
+          get(readBytes, offset, gridDelta) && get(readBytes, offset, depth)))
+      return false;
+
+    labels.resize(numLabels);
+    for (auto &label : labels) {
+      uint32_t length = 0;
+      if (!get(readBytes, offset, length) || length > fileSize - offset)
+        return false;
+      label.resize(length);
+      if (!readBytes(offset, &label[0], length))
+        return false;
+      offset += length;
+    }
+
+    // all columns have to fit into the file, which also prevents an overflow
+    // of the column sizes
+    if (dataOffset < offset || dataOffset > fileSize)
+      return false;
+    if (numLabels > 0 && numberOfCells > fileSize / valueSize)
+      return false;
+    const size_t columnSize = numberOfCells * valueSize;
+    const size_t columnStride =
+        (columnSize + alignment - 1) / alignment * alignment;
+    if (numLabels > 0 && columnStride > (fileSize - dataOffset) / numLabels)
+      return false;
+    std::vector<char> buffer;
+    for (size_t i = 0; i < labels.size(); i++) {
+      auto column = getColumn(labels[i]);
+      if (column == nullptr)
+        continue;
+      column->resize(numberOfCells);
+      const size_t columnOffset = dataOffset + i * columnStride;
+
+      if (valueSize == sizeof(T)) {
+        if (!readBytes(columnOffset, column->data(), columnSize))
+          return false;
+        if (!isLittleEndian()) {
+          for (auto &value : *column)
+            swapBytes(value);
+        }
+      } else {
+        // values were written with a different precision
+        buffer.resize(columnSize);
+        if (!readBytes(columnOffset, buffer.data(), columnSize))
+          return false;
+        for (size_t j = 0; j < numberOfCells; j++) {
+          if (valueSize == sizeof(float))
+            column->at(j) = convert<float>(buffer.data() + j * valueSize);
+          else
+            column->at(j) = convert<double>(buffer.data() + j * valueSize);
+        }
+      }
+    }
+    return true;
+  }
+
+  size_t getDataOffset() const {
+    size_t size = sizeof(magic) + 4 * sizeof(uint32_t) + 2 * sizeof(uint64_t) +
+                  2 * sizeof(double);
+    for (const auto &label : labels)
+      size += sizeof(uint32_t) + label.size();
+    return (size + alignment - 1) / alignment * alignment;
+  }
+
+  size_t getColumnStride() const {
+    return (numberOfCells * sizeof(T) + alignment - 1) / alignment * alignment;
+  }
+
+  static bool isLittleEndian() {
+    const uint16_t value = 1;
+    char byte;
+    std::memcpy(&byte, &value, 1);
+    return byte == 1;
+  }
+
+  template <class V> static void swapBytes(V &value) {
+    char bytes[sizeof(V)];
+    std::memcpy(bytes, &value, sizeof(V));
+    for (size_t i = 0; i < sizeof(V) / 2; i++)
+      std::swap(bytes[i], bytes[sizeof(V) - 1 - i]);
+    std::memcpy(&value, bytes, sizeof(V));
+  }
+
+  template <class V> static void append(std::vector<char> &buffer, V value) {
+    if (!isLittleEndian())
+      swapBytes(value);
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(V));
+  }
+
+  template <class ReadFunction, class V>
+  static bool get(ReadFunction &readBytes, size_t &offset, V &value) {
+    if (!readBytes(offset, &value, sizeof(V)))
+      return false;
+    if (!isLittleEndian())
+      swapBytes(value);
+    offset += sizeof(V);
+    return true;
+  }
+
+  template <class V> static T convert(const char *bytes) {
+    V value;
+    std::memcpy(&value, bytes, sizeof(V));
+    if (!isLittleEndian())
+      swapBytes(value);
+    return static_cast<T>(value);
+  }
+
+  static bool openError(const std::string &fileName) {
+    psLogger::getInstance()
+        .addWarning("Could not open file " + fileName)
+        .print();
+    return false;
+  }
+};
@@ -2,14 +2,19 @@
 #define DENSE_CELL_SET
 
 #include <csBVH.hpp>
+#include <csBrickStore.hpp>
+#include <csCellSetFile.hpp>
+#include <csToVoxelMesh.hpp>
 #include <csTracePath.hpp>
 #include <csUtil.hpp>
 
+#include <hrleDenseCellIterator.hpp>
+#include <hrleSparseIterator.hpp>
+
 #include <lsDomain.hpp>
 #include <lsMakeGeometry.hpp>
 #include <lsMesh.hpp>
 #include <lsToSurfaceMesh.hpp>
-#include <lsToVoxelMesh.hpp>
 
 #include <rayUtil.hpp>
 
@@ -30,17 +35,35 @@ private:
   levelSetsType levelSets = nullptr;
   gridType cellGrid = nullptr;
   psSmartPointer<lsDomain<T, D>> surface = nullptr;
+  psSmartPointer<lsDomain<T, D>> plane = nullptr; // depth of the cell set
   psSmartPointer<csBVH<T, D>> BVH = nullptr;
-  std::vector<std::array<int, 2 * D>> cellNeighbors; // -x, x, -y, y, -z, z
+  // scalar data which is paged out to a scratch file
+  psSmartPointer<csBrickStore<T>> brickStore = nullptr;
+  // -x, x, -y, y, -z, z
+  std::vector<std::array<csIndexType, 2 * D>> cellNeighbors;
+  // material ids of the cells, the scalar data "Material" is a copy for output
+  std::vector<csMaterialIdType> cellMaterials;
   T gridDelta;
   size_t numberOfCells;
   T depth = 0.;
   int BVHlayers = 0;
   bool cellSetAboveSurface = false;
+  // cells further away from the surface are not created, 0 creates all cells
+  T narrowBandWidth = 0.;
+  // cells far away from the surface are merged into coarser cells
+  unsigned maxCellLevel = 0;
+  T coarseningDistance = 0.;
+  std::vector<unsigned char> cellLevels; // empty if no cells were merged
   std::vector<T> *fillingFractions;
   const T eps = 1e-4;
   hrleVectorType<hrleIndexType, D> minIndex, maxIndex;
 
+  // state of the level sets at the last material update
+  std::vector<size_t> levelSetFingerprints;
+  std::vector<std::vector<hrleVectorType<hrleIndexType, D>>> levelSetPoints;
+  std::vector<std::vector<hrleVectorType<hrleIndexType, D>>>
+      levelSetSurfacePoints;
+
 public:
   csDenseCellSet() {}
 
@@ -52,6 +75,13 @@ public:
 
   void fromLevelSets(levelSetsType passedLevelSets, T passedDepth = 0.) {
     levelSets = passedLevelSets;
+    // the largest id marks cells without material
+    if (levelSets->size() >= std::numeric_limits<csMaterialIdType>::max()) {
+      psLogger::getInstance()
+          .addError("Too many level sets for the material ids of the cell "
+                    "set.")
+          .print();
+    }
 
     if (cellGrid == nullptr)
       cellGrid = psSmartPointer<lsMesh<T>>::New();
@@ -63,10 +93,11 @@ public:
 
     gridDelta = surface->getGrid().getGridDelta();
 
-    depth = passedDepth;
-    std::vector<psSmartPointer<lsDomain<T, D>>> levelSetsInOrder;
-    auto plane = psSmartPointer<lsDomain<T, D>>::New(surface->getGrid());
-    {
+    // the plane only has to be recreated if the depth or the grid changed
+    if (plane == nullptr || depth != passedDepth ||
+        !isSameGrid(plane->getGrid(), surface->getGrid())) {
+      depth = passedDepth;
+      plane = psSmartPointer<lsDomain<T, D>>::New(surface->getGrid());
       T origin[D] = {0.};
       T normal[D] = {0.};
       origin[D - 1] = depth;
@@ -75,16 +106,24 @@ public:
                            psSmartPointer<lsPlane<T, D>>::New(origin, normal))
           .apply();
     }
-    if (!cellSetAboveSurface)
-      levelSetsInOrder.push_back(plane);
-    for (auto ls : *levelSets)
-      levelSetsInOrder.push_back(ls);
-    if (cellSetAboveSurface)
-      levelSetsInOrder.push_back(plane);
+    auto levelSetsInOrder = getLevelSetsInOrder();
+    // the next material update has to visit all cells
+    levelSetFingerprints.clear();
+    levelSetPoints.clear();
+    levelSetSurfacePoints.clear();
+    cellNeighbors.clear();
+    cellLevels.clear();
+    if (brickStore)
+      brickStore->clear();
 
     calculateMinMaxIndex(levelSetsInOrder);
-    lsToVoxelMesh<T, D>(levelSetsInOrder, cellGrid).apply();
-    // lsToVoxelMesh also saves the extent in the cell grid
+    {
+      csToVoxelMesh<T, D> voxelConverter(levelSetsInOrder, cellGrid);
+      if (narrowBandWidth > 0.)
+        voxelConverter.setNarrowBand(surface, narrowBandWidth);
+      voxelConverter.apply();
+    }
+    // csToVoxelMesh also saves the extent in the cell grid
 
 #ifndef NDEBUG
     int db_ls = 0;
@@ -100,8 +139,12 @@ public:
     if (!cellSetAboveSurface)
       adjustMaterialIds();
 
-    // create filling fractions as default scalar cell data
     numberOfCells = cellGrid->template getElements<(1 << D)>().size();
+    if (maxCellLevel > 0)
+      coarsenCells();
+    loadMaterialIds();
+
+    // create filling fractions as default scalar cell data
     std::vector<T> fillingFractionsTemp(numberOfCells, 0.);
 
     cellGrid->getCellData().insertNextScalarData(
@@ -157,7 +200,7 @@ public:
     return cellGrid->getNodes();
   }
 
-  std::vector<std::array<unsigned, (1 << D)>> getElements() {
+  std::vector<std::array<unsigned, (1 << D)>> &getElements() {
     return cellGrid->template getElements<(1 << D)>();
   }
 
@@ -177,12 +220,20 @@ public:
     return getFillingFractions()->at(idx);
   }
 
-  int getIndex(std::array<T, 3> &point) { return findIndex(point); }
+  csIndexType getIndex(std::array<T, 3> &point) { return findIndex(point); }
 
   std::vector<T> *getScalarData(std::string name) {
     return cellGrid->getCellData().getScalarData(name);
   }
 
+  // Material ids of all cells. The scalar data "Material" holds the same ids
+  // for output, changes to it are not taken over.
+  const std::vector<csMaterialIdType> &getMaterialIds() const {
+    return cellMaterials;
+  }
+
+  int getMaterial(const size_t cellIdx) const { return cellMaterials[cellIdx]; }
+
   // Set whether the cell set should be created below (false) or above (true)
   // the surface.
   void setCellSetPosition(const bool passedCellSetPosition) {
@@ -191,8 +242,58 @@ public:
 
   bool getCellSetPosition() const { return cellSetAboveSurface; }
 
+  // Only create cells within the given distance of the surface, instead of
+  // the whole volume down to the depth of the cell set. Memory and setup time
+  // then scale with the surface area. The band is set up when the cell set is
+  // created from the level sets, if the surface moves further than the width
+  // of the band, the cell set has to be created again. 0 creates all cells.
+  void setNarrowBandWidth(const T width) { narrowBandWidth = width; }
+
+  T getNarrowBandWidth() const { return narrowBandWidth; }
+
+  // Merge aligned blocks of cells with the same material into coarser cells
+  // when the cell set is created. A cell of level l covers 2^l cells of
+  // gridDelta in each direction and is only created if it is at least
+  // distance * 2^(l-1) away from the surface, so the resolution decreases
+  // geometrically with the distance to the surface. 0 keeps all cells at full
+  // resolution.
+  void setCoarsening(const unsigned maxLevel, const T distance) {
+    maxCellLevel = maxLevel;
+    coarseningDistance = distance;
+  }
+
+  bool hasCoarseCells() const { return !cellLevels.empty(); }
+
+  unsigned getCellLevel(const size_t cellIdx) const {
+    return cellLevels.empty() ? 0 : cellLevels[cellIdx];
+  }
+
+  // Edge length of a cell.
+  T getCellSize(const size_t cellIdx) const {
+    return gridDelta * (1 << getCellLevel(cellIdx));
+  }
+
+  // Index of the cell of gridDelta which contains the point inside of a
+  // coarse cell, 0 for cells with full resolution.
+  int getSubCellIndex(const csIndexType cellIdx,
+                      const std::array<T, 3> &point) const {
+    if (cellIdx < 0 || getCellLevel(cellIdx) == 0)
+      return 0;
+    const hrleIndexType size = 1 << getCellLevel(cellIdx);
+    const auto index = getCellIndex(cellIdx);
+    int subCellIndex = 0;
+    for (int i = D - 1; i >= 0; --i) {
+      auto offset =
+          static_cast<hrleIndexType>(std::floor(point[i] / gridDelta)) -
+          index[i];
+      offset = std::min(std::max(offset, hrleIndexType(0)), size - 1);
+      subCellIndex = subCellIndex * size + offset;
+    }
+    return subCellIndex;
+  }
+
   // Sets the filling fraction at given cell index.
-  bool setFillingFraction(const int idx, const T fill) {
+  bool setFillingFraction(const csIndexType idx, const T fill) {
     if (idx < 0)
       return false;
 
@@ -207,7 +308,7 @@ public:
   }
 
   // Add to the filling fraction at given cell index.
-  bool addFillingFraction(int idx, T fill) {
+  bool addFillingFraction(csIndexType idx, T fill) {
     if (idx < 0)
       return false;
 
@@ -226,20 +327,96 @@ public:
   bool addFillingFractionInMaterial(const std::array<T, 3> &point, T fill,
                                     int materialId) {
     auto idx = findIndex(point);
-    if (getScalarData("Material")->at(idx) == materialId)
+    if (idx >= 0 && cellMaterials[idx] == materialId)
       return addFillingFraction(idx, fill);
     else
       return false;
   }
 
-  // Write the cell set as .vtu file
+  // Keep scalar data which is paged out in the given scratch file. The data
+  // is loaded in bricks of brickSize consecutive cells and at most
+  // cachedBricks bricks are kept in memory. Only scalar data can be paged
+  // out, the cell grid, the neighborhood and the BVH always stay in memory.
+  void setScratchFile(const std::string &fileName,
+                      const size_t brickSize = 1 << 16,
+                      const size_t cachedBricks = 64) {
+    if (brickStore) {
+      for (int i = 0; i < cellGrid->getCellData().getScalarDataSize(); i++)
+        pageIn(cellGrid->getCellData().getScalarDataLabel(i));
+    }
+    brickStore = psSmartPointer<csBrickStore<T>>::New(fileName, brickSize,
+                                                      cachedBricks);
+  }
+
+  // Move scalar data to the scratch file to free its memory. Until it is
+  // paged in again, getScalarData returns an empty vector and the data can
+  // only be accessed through the brick store. The filling fractions and the
+  // material ids are always kept in memory.
+  void pageOut(const std::string &name) {
+    auto data = getScalarData(name);
+    if (brickStore == nullptr || data == nullptr ||
+        name == "fillingFraction" || name == "Material") {
+      psLogger::getInstance()
+          .addWarning("Cannot page out cell set data " + name + ".")
+          .print();
+      return;
+    }
+    if (isPagedOut(name))
+      return;
+    brickStore->insertField(name, *data);
+    std::vector<T>().swap(*data);
+  }
+
+  void pageIn(const std::string &name) {
+    if (!isPagedOut(name))
+      return;
+    brickStore->readField(name, *getScalarData(name));
+    brickStore->removeField(name);
+  }
+
+  bool isPagedOut(const std::string &name) const {
+    return brickStore && brickStore->hasField(name);
+  }
+
+  psSmartPointer<csBrickStore<T>> getBrickStore() const { return brickStore; }
+
+  // Write the cell set as .vtu file. Scalar data which is paged out is loaded
+  // for writing.
   void writeVTU(std::string fileName) {
+    std::vector<std::vector<T> *> pagedData;
+    for (int i = 0; i < cellGrid->getCellData().getScalarDataSize(); i++) {
+      const auto label = cellGrid->getCellData().getScalarDataLabel(i);
+      if (isPagedOut(label)) {
+        pagedData.push_back(getScalarData(label));
+        brickStore->readField(label, *pagedData.back());
+      }
+    }
     psVTKWriter<T>(cellGrid, fileName).apply();
+    // the scratch file still holds the data
+    for (auto data : pagedData)
+      std::vector<T>().swap(*data);
   }
 
-  // Save cell set data in simple text format
-  void writeCellSetData(std::string fileName) const {
+  // Save cell set data in simple text format, or in the binary format of
+  // csCellSetFile, which is much faster to write and read for large cell sets.
+  void writeCellSetData(std::string fileName, bool binary = false) const {
     auto numScalarData = cellGrid->getCellData().getScalarDataSize();
+    std::vector<std::vector<T>> pagedData;
+    const auto columns = getOutputData(pagedData);
+
+    if (binary) {
+      csCellSetFile<T> cellSetFile;
+      cellSetFile.dimension = D;
+      cellSetFile.numberOfCells = numberOfCells;
+      cellSetFile.gridDelta = gridDelta;
+      cellSetFile.depth = depth;
+      for (int i = 0; i < numScalarData; i++) {
+        cellSetFile.labels.push_back(
+            cellGrid->getCellData().getScalarDataLabel(i));
+      }
+      cellSetFile.write(fileName, columns);
+      return;
+    }
 
     std::ofstream file(fileName);
     file << numberOfCells << "\n";
@@ -251,7 +428,7 @@ public:
 
     for (size_t j = 0; j < numberOfCells; j++) {
       for (int i = 0; i < numScalarData; i++) {
-        file << cellGrid->getCellData().getScalarData(i)->at(j) << ",";
+        file << columns[i]->at(j) << ",";
       }
       file << "\n";
     }
@@ -259,8 +436,31 @@ public:
     file.close();
   }
 
-  // Read cell set data from text
+  // Read cell set data from text or binary format
   void readCellSetData(std::string fileName) {
+    if (csCellSetFile<T>::isBinaryFile(fileName)) {
+      csCellSetFile<T> cellSetFile;
+      bool compatible = true;
+      cellSetFile.read(fileName, [&](const std::string &label) {
+        compatible = cellSetFile.numberOfCells == numberOfCells &&
+                     cellSetFile.dimension == D;
+        if (!compatible)
+          return static_cast<std::vector<T> *>(nullptr);
+        if (isPagedOut(label))
+          brickStore->removeField(label);
+        auto dataP = getScalarData(label);
+        if (dataP == nullptr)
+          dataP = addScalarData(label, 0.);
+        return dataP;
+      });
+      if (!compatible)
+        psLogger::getInstance()
+            .addWarning("Incompatible cell set data.")
+            .print();
+      loadMaterialIds();
+      return;
+    }
+
     std::ifstream file(fileName);
     std::string line;
 
@@ -292,6 +492,10 @@ public:
       auto dataP = getScalarData(labels[i]);
       if (dataP == nullptr) {
         dataP = addScalarData(labels[i], 0.);
+      } else if (isPagedOut(labels[i])) {
+        // the data is replaced, so it does not have to be paged in
+        brickStore->removeField(labels[i]);
+        dataP->resize(numberOfCells);
       }
     }
 
@@ -312,6 +516,7 @@ public:
     assert(j == numberOfCells && "Data incompatible");
 
     file.close();
+    loadMaterialIds();
   }
 
   // Clear the filling fractions
@@ -323,215 +528,165 @@ public:
   // Update the material IDs of the cell set. This function should be called if
   // the level sets, the cell set is made out of, have changed. This does not
   // work if the surface of the volume has changed. In this case, call the
-  // funciton update surface first.
-  void updateMaterials() {
+  // funciton update surface first. Only cells close to level sets which
+  // changed since the last call are updated, unless fullUpdate is set.
+  void updateMaterials(const bool fullUpdate = false) {
+    auto levelSetsInOrder = getLevelSetsInOrder();
     auto materialIds = getScalarData("Material");
-
-    // create overlay material
-    std::vector<psSmartPointer<lsDomain<T, D>>> levelSetsInOrder;
-    auto plane = psSmartPointer<lsDomain<T, D>>::New(surface->getGrid());
-    {
-      T origin[D] = {0.};
-      T normal[D] = {0.};
-      origin[D - 1] = depth;
-      normal[D - 1] = 1.;
-      lsMakeGeometry<T, D>(plane,
-                           psSmartPointer<lsPlane<T, D>>::New(origin, normal))
-          .apply();
+    auto copyMaterialId = [this, materialIds](size_t i) {
+      materialIds->at(i) = cellMaterials[i];
+    };
+
+    // Material ids can only change in cells touching a defined point of a
+    // level set which was modified, either before or after the modification,
+    // as long as the surface did not move further than the narrow band. The
+    // first update after creating the cell set visits all cells.
+    bool updateAll =
+        fullUpdate || levelSetFingerprints.size() != levelSets->size();
+    std::vector<size_t> fingerprints(levelSets->size());
+    std::vector<std::vector<hrleVectorType<hrleIndexType, D>>> points(
+        levelSets->size());
+    std::vector<std::vector<hrleVectorType<hrleIndexType, D>>> surfacePoints(
+        levelSets->size());
+    const long long numLevelSets = levelSets->size();
+#pragma omp parallel for schedule(dynamic)
+    for (long long l = 0; l < numLevelSets; ++l) {
+      fingerprints[l] =
+          getDefinedPoints(levelSets->at(l), points[l], surfacePoints[l]);
     }
-    if (!cellSetAboveSurface)
-      levelSetsInOrder.push_back(plane);
-    for (auto ls : *levelSets)
-      levelSetsInOrder.push_back(ls);
-    if (cellSetAboveSurface)
-      levelSetsInOrder.push_back(plane);
-
-    // set up iterators for all materials
-    std::vector<hrleConstDenseCellIterator<typename lsDomain<T, D>::DomainType>>
-        iterators;
-    for (auto it = levelSetsInOrder.begin(); it != levelSetsInOrder.end();
-         ++it) {
-      iterators.push_back(
-          hrleConstDenseCellIterator<typename lsDomain<T, D>::DomainType>(
-              (*it)->getDomain(), minIndex));
-    }
-
-    // move iterator for lowest material id and then adjust others if they are
-    // needed
-    unsigned cellIdx = 0;
-    for (; iterators.front().getIndices() < maxIndex;
-         iterators.front().next()) {
-      // go over all materials
-      for (unsigned materialId = 0; materialId < levelSetsInOrder.size();
-           ++materialId) {
-
-        auto &cellIt = iterators[materialId];
-        cellIt.goToIndicesSequential(iterators.front().getIndices());
-
-        // find out whether the centre of the box is inside
-        T centerValue = 0.;
-        for (int i = 0; i < (1 << D); ++i) {
-          centerValue += cellIt.getCorner(i).getValue();
-        }
 
-        if (centerValue <= 0.) {
-          bool isVoxel;
-          // check if voxel is in bounds
-          for (unsigned i = 0; i < (1 << D); ++i) {
-            hrleVectorType<hrleIndexType, D> index;
-            isVoxel = true;
-            for (unsigned j = 0; j < D; ++j) {
-              index[j] =
-                  cellIt.getIndices(j) + cellIt.getCorner(i).getOffset()[j];
-              if (index[j] > maxIndex[j]) {
-                isVoxel = false;
-                break;
-              }
-            }
-          }
+    // The cells between the old and the new surface are only covered if each
+    // surface lies within the narrow band of the other one
+    for (unsigned l = 0; !updateAll && l < levelSets->size(); ++l) {
+      if (fingerprints[l] != levelSetFingerprints[l] &&
+          (!containsAll(levelSetPoints[l], surfacePoints[l]) ||
+           !containsAll(points[l], levelSetSurfacePoints[l])))
+        updateAll = true;
+    }
 
-          if (isVoxel) {
-            materialIds->at(cellIdx++) = materialId;
-          }
+    if (updateAll) {
+      assignMaterials(levelSetsInOrder, numberOfCells,
+                      [](size_t i) { return i; }, cellMaterials);
+      const long long n = numberOfCells;
+#pragma omp parallel for
+      for (long long i = 0; i < n; ++i)
+        copyMaterialId(i);
+    } else {
+      std::vector<hrleVectorType<hrleIndexType, D>> changedPoints;
+      for (unsigned l = 0; l < levelSets->size(); ++l) {
+        if (fingerprints[l] == levelSetFingerprints[l])
+          continue;
+        changedPoints.insert(changedPoints.end(), levelSetPoints[l].begin(),
+                             levelSetPoints[l].end());
+        changedPoints.insert(changedPoints.end(), points[l].begin(),
+                             points[l].end());
+      }
 
-          // jump out of material for loop
-          break;
-        }
+      if (!changedPoints.empty()) {
+        auto cellIds = findCellsAtPoints(changedPoints);
+        assignMaterials(levelSetsInOrder, cellIds.size(),
+                        [&cellIds](size_t i) { return cellIds[i]; },
+                        cellMaterials);
+        const long long n = cellIds.size();
+#pragma omp parallel for
+        for (long long i = 0; i < n; ++i)
+          copyMaterialId(cellIds[i]);
       }
     }
-    assert(cellIdx == numberOfCells &&
-           "Cell set changed in `updateMaterials()'");
+
+    levelSetFingerprints.swap(fingerprints);
+    levelSetPoints.swap(points);
+    levelSetSurfacePoints.swap(surfacePoints);
   }
 
   // Updates the surface of the cell set. The new surface should be below the
   // old surface as this function can only remove cells from the cell set.
   void updateSurface() {
-    auto updateCellGrid = psSmartPointer<lsMesh<T>>::New();
+    // Cells which are located between the new and the old surface (material
+    // 2) are removed.
+    std::vector<csMaterialIdType> cutMatIds(
+        numberOfCells, std::numeric_limits<csMaterialIdType>::max());
+    assignMaterials({plane, levelSets->back(), surface}, numberOfCells,
+                    [](size_t i) { return i; }, cutMatIds);
 
-    lsToVoxelMesh<T, D> voxelConverter(updateCellGrid);
-    {
-      auto plane = psSmartPointer<lsDomain<T, D>>::New(surface->getGrid());
-      T origin[D] = {0.};
-      T normal[D] = {0.};
-      origin[D - 1] = depth;
-      normal[D - 1] = 1.;
+    std::vector<csIndexType> newIndices(numberOfCells);
+    const auto newNumberOfCells = csUtil::compactionIndices(
+        newIndices, [&cutMatIds](size_t i) { return cutMatIds[i] != 2; });
 
-      lsMakeGeometry<T, D>(plane,
-                           psSmartPointer<lsPlane<T, D>>::New(origin, normal))
-          .apply();
-      voxelConverter.insertNextLevelSet(plane);
-    }
-    voxelConverter.insertNextLevelSet(levelSets->back());
-    voxelConverter.insertNextLevelSet(surface);
-    voxelConverter.apply();
-
-    auto cutMatIds = updateCellGrid->getCellData().getScalarData("Material");
-    auto &hexas = cellGrid->template getElements<(1 << D)>();
-
-    const auto nCutCells =
-        updateCellGrid->template getElements<(1 << D)>().size();
-
-    auto numScalarData = cellGrid->getCellData().getScalarDataSize();
+    if (newNumberOfCells != numberOfCells)
+      compactCells(newIndices, newNumberOfCells);
 
-    for (int elIdx = nCutCells - 1; elIdx >= 0; elIdx--) {
-      if (cutMatIds->at(elIdx) == 2) {
-        for (int i = 0; i < numScalarData; i++) {
-          auto data = cellGrid->getCellData().getScalarData(i);
-          data->erase(data->begin() + elIdx);
-        }
-        hexas.erase(hexas.begin() + elIdx);
-      }
-    }
-    numberOfCells = hexas.size();
     surface->deepCopy(levelSets->back());
-
-    buildBVH();
   }
 
-  // Merge a trace path to the cell set.
-  void mergePath(csTracePath<T> &path, T factor = 1.) {
+  // Merge a trace path to the cell set. Deposits in coarse cells are divided
+  // by the number of cells of gridDelta they cover, so the filling fraction
+  // is the mean over this volume.
+  template <class GridDataType>
+  void mergePath(csTracePath<T, GridDataType> &path, T factor = 1.) {
     auto ff = getFillingFractions();
     if (!path.getData().empty()) {
       for (const auto it : path.getData()) {
-        ff->at(it.first) += it.second / factor;
+        ff->at(it.first) += it.second / (factor * getVolumeFactor(it.first));
       }
     }
 
     if (!path.getGridData().empty()) {
       const auto &data = path.getGridData();
       for (size_t idx = 0; idx < numberOfCells; idx++) {
-        ff->at(idx) += data[idx] / factor;
+        ff->at(idx) += data[idx] / (factor * getVolumeFactor(idx));
       }
     }
   }
 
+  // Each cell gets one neighbor per face. If a coarse cell borders several
+  // finer cells on a face, the one at the lowest corner of the face is used.
   void buildNeighborhood() {
-    const auto &cells = cellGrid->template getElements<(1 << D)>();
-    const auto &nodes = cellGrid->getNodes();
-    unsigned const numNodes = nodes.size();
-    unsigned const numCells = cells.size();
-    cellNeighbors.resize(numCells);
-
-    std::vector<std::vector<unsigned>> nodeCellConnections(numNodes);
-
-    // for each node, store which cells are connected with the node
-    for (unsigned cellIdx = 0; cellIdx < numCells; cellIdx++) {
-      for (unsigned cellNodeIdx = 0; cellNodeIdx < (1 << D); cellNodeIdx++) {
-        nodeCellConnections[cells[cellIdx][cellNodeIdx]].push_back(cellIdx);
-      }
-    }
+    cellNeighbors.resize(numberOfCells);
 
+    const long long n = numberOfCells;
 #pragma omp parallel for
-    for (unsigned cellIdx = 0; cellIdx < numCells; cellIdx++) {
-      auto coord = nodes[cells[cellIdx][0]];
+    for (long long cellIdx = 0; cellIdx < n; cellIdx++) {
+      const auto index = getCellIndex(cellIdx);
+      const hrleIndexType size = 1 << getCellLevel(cellIdx);
       for (int i = 0; i < D; i++) {
-        coord[i] += gridDelta / 2.;
-        cellNeighbors[cellIdx][i] = -1;
-        cellNeighbors[cellIdx][i + D] = -1;
-      }
-
-      for (unsigned cellNodeIdx = 0; cellNodeIdx < (1 << D); cellNodeIdx++) {
-        auto &cellsAtNode = nodeCellConnections[cells[cellIdx][cellNodeIdx]];
-
-        for (const auto &neighborCell : cellsAtNode) {
-          if (neighborCell != cellIdx) {
-
-            auto neighborCoord = nodes[cells[neighborCell][0]];
-            for (int i = 0; i < D; i++)
-              neighborCoord[i] += gridDelta / 2.;
-
-            if (csUtil::distance(coord, neighborCoord) < gridDelta + eps) {
-
-              for (int i = 0; i < D; i++) {
-                if (coord[i] - neighborCoord[i] > gridDelta / 2.) {
-                  cellNeighbors[cellIdx][i * 2] = neighborCell;
-                } else if (coord[i] - neighborCoord[i] < -gridDelta / 2.) {
-                  cellNeighbors[cellIdx][i * 2 + 1] = neighborCell;
-                }
-              }
-            }
-          }
-        }
+        auto neighborIndex = index;
+        neighborIndex[i] -= 1;
+        auto neighbor = findContainingCell(neighborIndex);
+        cellNeighbors[cellIdx][i * 2] =
+            (neighbor < numberOfCells) ? csIndexType(neighbor) : -1;
+
+        neighborIndex[i] += size + 1;
+        neighbor = findContainingCell(neighborIndex);
+        cellNeighbors[cellIdx][i * 2 + 1] =
+            (neighbor < numberOfCells) ? csIndexType(neighbor) : -1;
       }
     }
   }
 
-  const std::array<int, 2 * D> &getNeighbors(unsigned long cellIdx) {
+  // Returns the neighbors of all cells, the neighborhood is built if needed.
+  const std::vector<std::array<csIndexType, 2 * D>> &getNeighborhood() {
+    if (cellNeighbors.size() != numberOfCells)
+      buildNeighborhood();
+    return cellNeighbors;
+  }
+
+  const std::array<csIndexType, 2 * D> &getNeighbors(size_t cellIdx) {
     assert(cellIdx < numberOfCells && "Cell idx out of bounds");
     return cellNeighbors[cellIdx];
   }
 
 private:
-  int findIndex(const csTriple<T> &point) {
+  csIndexType findIndex(const csTriple<T> &point) {
     const auto &elems = cellGrid->template getElements<(1 << D)>();
     const auto &nodes = cellGrid->getNodes();
-    int idx = -1;
+    csIndexType idx = -1;
 
     auto cellIds = BVH->getCellIds(point);
     if (!cellIds)
       return idx;
     for (const auto cellId : *cellIds) {
-      if (isInsideVoxel(point, nodes[elems[cellId][0]])) {
+      if (isInsideVoxel(point, nodes[elems[cellId][0]], getCellSize(cellId))) {
         idx = cellId;
         break;
       }
@@ -539,6 +694,38 @@ private:
     return idx;
   }
 
+  // Scalar data for output. Data which is paged out is read from the scratch
+  // file into pagedData.
+  std::vector<const std::vector<T> *>
+  getOutputData(std::vector<std::vector<T>> &pagedData) const {
+    const auto numScalarData = cellGrid->getCellData().getScalarDataSize();
+    std::vector<const std::vector<T> *> data;
+    pagedData.reserve(numScalarData);
+    for (int i = 0; i < numScalarData; i++) {
+      const auto label = cellGrid->getCellData().getScalarDataLabel(i);
+      if (isPagedOut(label)) {
+        pagedData.emplace_back();
+        brickStore->readField(label, pagedData.back());
+        data.push_back(&pagedData.back());
+      } else {
+        data.push_back(cellGrid->getCellData().getScalarData(i));
+      }
+    }
+    return data;
+  }
+
+  // Take the material ids from the scalar data "Material".
+  void loadMaterialIds() {
+    auto materialIds = getScalarData("Material");
+    cellMaterials.resize(numberOfCells);
+    if (materialIds == nullptr || materialIds->size() != numberOfCells)
+      return;
+    const long long n = numberOfCells;
+#pragma omp parallel for
+    for (long long i = 0; i < n; ++i)
+      cellMaterials[i] = static_cast<csMaterialIdType>(materialIds->at(i));
+  }
+
   void adjustMaterialIds() {
     auto matIds = getScalarData("Material");
 
@@ -550,7 +737,8 @@ private:
     }
   }
 
-  int findSurfaceHitPoint(csTriple<T> &hitPoint, const csTriple<T> &direction) {
+  csIndexType findSurfaceHitPoint(csTriple<T> &hitPoint,
+                                  const csTriple<T> &direction) {
     // find surface hitpoint
     auto idx = findIndex(hitPoint);
 
@@ -570,14 +758,282 @@ private:
     return idx;
   }
 
-  bool isInsideVoxel(const csTriple<T> &point, const csTriple<T> &cellMin) {
+  std::vector<psSmartPointer<lsDomain<T, D>>> getLevelSetsInOrder() const {
+    std::vector<psSmartPointer<lsDomain<T, D>>> levelSetsInOrder;
+    if (!cellSetAboveSurface)
+      levelSetsInOrder.push_back(plane);
+    for (auto ls : *levelSets)
+      levelSetsInOrder.push_back(ls);
+    if (cellSetAboveSurface)
+      levelSetsInOrder.push_back(plane);
+    return levelSetsInOrder;
+  }
+
+  // Grid index of the lowest corner of a cell.
+  hrleVectorType<hrleIndexType, D> getCellIndex(const size_t cellId) const {
+    const auto &node =
+        cellGrid->getNodes()[cellGrid->template getElements<(1 << D)>()[cellId]
+                                                                      [0]];
+    hrleVectorType<hrleIndexType, D> index;
+    for (unsigned i = 0; i < D; ++i)
+      index[i] = static_cast<hrleIndexType>(std::round(node[i] / gridDelta));
+    return index;
+  }
+
+  // Order in which the cells are created from the level sets.
+  static bool isBefore(const hrleVectorType<hrleIndexType, D> &a,
+                       const hrleVectorType<hrleIndexType, D> &b) {
+    for (int i = D - 1; i >= 0; --i) {
+      if (a[i] != b[i])
+        return a[i] < b[i];
+    }
+    return false;
+  }
+
+  // Stores the indices of all defined points of the level set, and of the
+  // points next to the surface, and returns a hash of the indices and values
+  // of the defined points. The points are stored in the order of isBefore.
+  static size_t getDefinedPoints(
+      const psSmartPointer<lsDomain<T, D>> &levelSet,
+      std::vector<hrleVectorType<hrleIndexType, D>> &points,
+      std::vector<hrleVectorType<hrleIndexType, D>> &surfacePoints) {
+    points.clear();
+    points.reserve(levelSet->getNumberOfPoints());
+    surfacePoints.clear();
+    size_t hash = levelSet->getNumberOfPoints();
+    auto combine = [&hash](size_t value) {
+      hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    };
+    for (hrleConstSparseIterator<typename lsDomain<T, D>::DomainType> it(
+             levelSet->getDomain());
+         !it.isFinished(); ++it) {
+      if (!it.isDefined())
+        continue;
+      auto index = it.getStartIndices();
+      for (unsigned i = 0; i < D; ++i)
+        combine(std::hash<hrleIndexType>{}(index[i]));
+      combine(std::hash<T>{}(it.getValue()));
+      points.push_back(index);
+      if (std::abs(it.getValue()) <= 0.5)
+        surfacePoints.push_back(index);
+    }
+    return hash;
+  }
+
+  // Whether all points are contained in the sorted points.
+  static bool
+  containsAll(const std::vector<hrleVectorType<hrleIndexType, D>> &sorted,
+              const std::vector<hrleVectorType<hrleIndexType, D>> &points) {
+    for (const auto &point : points) {
+      if (!std::binary_search(sorted.begin(), sorted.end(), point, isBefore))
+        return false;
+    }
+    return true;
+  }
+
+  // Returns the sorted ids of all cells which contain a cell of gridDelta
+  // with one of the grid points as a corner.
+  std::vector<size_t> findCellsAtPoints(
+      const std::vector<hrleVectorType<hrleIndexType, D>> &points) const {
+    std::vector<size_t> cellIds;
+    const long long numPoints = points.size();
+#pragma omp parallel
+    {
+      std::vector<size_t> threadCellIds;
+#pragma omp for nowait
+      for (long long p = 0; p < numPoints; ++p) {
+        for (unsigned corner = 0; corner < (1 << D); ++corner) {
+          auto index = points[p];
+          for (unsigned i = 0; i < D; ++i)
+            index[i] -= (corner >> i) & 1;
+          auto cellId = findContainingCell(index);
+          if (cellId < numberOfCells)
+            threadCellIds.push_back(cellId);
+        }
+      }
+#pragma omp critical
+      cellIds.insert(cellIds.end(), threadCellIds.begin(),
+                     threadCellIds.end());
+    }
+    std::sort(cellIds.begin(), cellIds.end());
+    cellIds.erase(std::unique(cellIds.begin(), cellIds.end()), cellIds.end());
+    return cellIds;
+  }
+
+  // Binary search for the cell with the given grid index. Returns
+  // numberOfCells if the cell is not part of the cell set.
+  size_t findCell(const hrleVectorType<hrleIndexType, D> &index) const {
+    size_t first = 0;
+    size_t count = numberOfCells;
+    while (count > 0) {
+      const size_t step = count / 2;
+      if (isBefore(getCellIndex(first + step), index)) {
+        first += step + 1;
+        count -= step + 1;
+      } else {
+        count = step;
+      }
+    }
+    if (first < numberOfCells) {
+      const auto cellIndex = getCellIndex(first);
+      if (!isBefore(index, cellIndex))
+        return first;
+    }
+    return numberOfCells;
+  }
+
+  // Returns the cell which contains the cell of gridDelta with the given grid
+  // index, or numberOfCells. Coarse cells are aligned to their size, so only
+  // one candidate per level has to be checked.
+  size_t
+  findContainingCell(const hrleVectorType<hrleIndexType, D> &index) const {
+    if (cellLevels.empty())
+      return findCell(index);
+    for (unsigned level = 0; level <= maxCellLevel; ++level) {
+      const auto cellId = findCell(alignIndex(index, level));
+      if (cellId < numberOfCells && cellLevels[cellId] == level)
+        return cellId;
+    }
+    return numberOfCells;
+  }
+
+  // Largest index aligned to cells of the level, which is not larger than the
+  // given index.
+  static hrleVectorType<hrleIndexType, D>
+  alignIndex(hrleVectorType<hrleIndexType, D> index, const unsigned level) {
+    const hrleIndexType size = 1 << level;
+    for (unsigned i = 0; i < D; ++i) {
+      auto remainder = index[i] % size;
+      if (remainder < 0)
+        remainder += size;
+      index[i] -= remainder;
+    }
+    return index;
+  }
+
+  // Number of cells of gridDelta covered by a cell.
+  T getVolumeFactor(const size_t cellIdx) const {
+    return static_cast<T>(size_t(1) << (D * getCellLevel(cellIdx)));
+  }
+
+  // Assigns each cell the first material which contains it. getCellId(i) has
+  // to return the cell ids in ascending order for i = 0, ..., numCells - 1,
+  // so that each thread can move its iterators sequentially through the
+  // grid. Cells outside of all materials keep their material id. Coarse cells
+  // are far away from the surface, their material is taken from the cell of
+  // gridDelta at their lowest corner.
+  template <class CellIdFunction, class MaterialIdType>
+  void assignMaterials(
+      const std::vector<psSmartPointer<lsDomain<T, D>>> &levelSetsInOrder,
+      const size_t numCells, CellIdFunction getCellId,
+      std::vector<MaterialIdType> &materialIds) {
+    using DomainType = typename lsDomain<T, D>::DomainType;
+
+#pragma omp parallel
+    {
+      const int numThreads = omp_get_num_threads();
+      const int threadNum = omp_get_thread_num();
+      const size_t begin = numCells * threadNum / numThreads;
+      const size_t end = numCells * (threadNum + 1) / numThreads;
+
+      if (begin < end) {
+        const auto startIndex = getCellIndex(getCellId(begin));
+        std::vector<hrleConstDenseCellIterator<DomainType>> iterators;
+        for (auto &ls : levelSetsInOrder)
+          iterators.emplace_back(ls->getDomain(), startIndex);
+
+        for (size_t i = begin; i < end; ++i) {
+          const auto cellId = getCellId(i);
+          const auto index = getCellIndex(cellId);
+          for (unsigned materialId = 0; materialId < iterators.size();
+               ++materialId) {
+            auto &cellIt = iterators[materialId];
+            cellIt.goToIndicesSequential(index);
+
+            // find out whether the centre of the box is inside
+            T centerValue = 0.;
+            for (int c = 0; c < (1 << D); ++c) {
+              centerValue += cellIt.getCorner(c).getValue();
+            }
+
+            if (centerValue <= 0.) {
+              materialIds[cellId] = static_cast<MaterialIdType>(materialId);
+              break;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Removes cells from the cell set. newIndices maps each old cell index to
+  // its new index, or to -1 if the cell is removed. The order of the remaining
+  // cells is preserved. Scalar data, elements, the neighborhood and the BVH
+  // are updated in place without rebuilding them.
+  void compactCells(const std::vector<csIndexType> &newIndices,
+                    const size_t newNumberOfCells) {
+    const auto oldNumberOfCells = newIndices.size();
+
+    // scalar data
+    {
+      std::vector<T> buffer;
+      buffer.reserve(newNumberOfCells);
+      auto numScalarData = cellGrid->getCellData().getScalarDataSize();
+      for (int i = 0; i < numScalarData; i++) {
+        if (isPagedOut(cellGrid->getCellData().getScalarDataLabel(i)))
+          continue;
+        auto data = cellGrid->getCellData().getScalarData(i);
+        csUtil::compact(*data, buffer, newIndices, newNumberOfCells);
+      }
+    }
+    if (brickStore)
+      brickStore->compact(newIndices, newNumberOfCells);
+
+    // elements
+    {
+      std::vector<std::array<unsigned, (1 << D)>> buffer;
+      csUtil::compact(cellGrid->template getElements<(1 << D)>(), buffer,
+                      newIndices, newNumberOfCells);
+    }
+
+    // neighborhood
+    if (cellNeighbors.size() == oldNumberOfCells) {
+      std::vector<std::array<csIndexType, 2 * D>> buffer;
+      csUtil::compact(cellNeighbors, buffer, newIndices, newNumberOfCells);
+      const long long count = newNumberOfCells;
+#pragma omp parallel for
+      for (long long i = 0; i < count; i++) {
+        for (auto &n : cellNeighbors[i]) {
+          if (n >= 0)
+            n = newIndices[n];
+        }
+      }
+    }
+
+    {
+      std::vector<csMaterialIdType> buffer;
+      csUtil::compact(cellMaterials, buffer, newIndices, newNumberOfCells);
+    }
+
+    if (!cellLevels.empty()) {
+      std::vector<unsigned char> buffer;
+      csUtil::compact(cellLevels, buffer, newIndices, newNumberOfCells);
+    }
+
+    BVH->remapCellIds(newIndices);
+
+    numberOfCells = newNumberOfCells;
+  }
+
+  bool isInsideVoxel(const csTriple<T> &point, const csTriple<T> &cellMin,
+                     const T cellSize) {
     if constexpr (D == 3)
-      return point[0] >= cellMin[0] && point[0] <= (cellMin[0] + gridDelta) &&
-             point[1] >= cellMin[1] && point[1] <= (cellMin[1] + gridDelta) &&
-             point[2] >= cellMin[2] && point[2] <= (cellMin[2] + gridDelta);
+      return point[0] >= cellMin[0] && point[0] <= (cellMin[0] + cellSize) &&
+             point[1] >= cellMin[1] && point[1] <= (cellMin[1] + cellSize) &&
+             point[2] >= cellMin[2] && point[2] <= (cellMin[2] + cellSize);
     else
-      return point[0] >= cellMin[0] && point[0] <= (cellMin[0] + gridDelta) &&
-             point[1] >= cellMin[1] && point[1] <= (cellMin[1] + gridDelta);
+      return point[0] >= cellMin[0] && point[0] <= (cellMin[0] + cellSize) &&
+             point[1] >= cellMin[1] && point[1] <= (cellMin[1] + cellSize);
   }
 
   void buildBVH() {
@@ -585,16 +1041,351 @@ private:
     auto &nodes = cellGrid->getNodes();
     BVH->clearCellIds();
 
-    for (size_t elemIdx = 0; elemIdx < elems.size(); elemIdx++) {
-      for (size_t n = 0; n < (1 << D); n++) {
-        auto &node = nodes[elems[elemIdx][n]];
-        auto cell = BVH->getCellIds(node);
-        if (cell == nullptr) {
-          psLogger::getInstance().addError("BVH building error.").print();
+    // The bounding volumes of the cell corners are found in parallel. The
+    // cell ids are then inserted serially, block by block, since the cell id
+    // sets are shared between threads. Coarse cells can overlap bounding
+    // volumes which contain none of their corners, so they are sampled at all
+    // grid points they cover.
+    constexpr size_t blockSize = 1 << 16;
+    std::vector<std::array<std::set<csIndexType> *, (1 << D)>> cellIdSets(
+        std::min(blockSize, elems.size()));
+    std::vector<std::vector<std::set<csIndexType> *>> coarseCellIdSets(
+        cellLevels.empty() ? 0 : cellIdSets.size());
+
+    for (size_t blockStart = 0; blockStart < elems.size();
+         blockStart += blockSize) {
+      const size_t blockEnd = std::min(blockStart + blockSize, elems.size());
+      const long long end = blockEnd;
+
+#pragma omp parallel for
+      for (long long elemIdx = blockStart; elemIdx < end; elemIdx++) {
+        auto &sets = cellIdSets[elemIdx - blockStart];
+        for (size_t n = 0; n < (1 << D); n++) {
+          sets[n] = BVH->getCellIds(nodes[elems[elemIdx][n]]);
+        }
+        if (getCellLevel(elemIdx) > 0)
+          getCoarseCellIdSets(elemIdx,
+                              coarseCellIdSets[elemIdx - blockStart]);
+      }
+
+      for (size_t elemIdx = blockStart; elemIdx < blockEnd; elemIdx++) {
+        if (getCellLevel(elemIdx) > 0) {
+          for (auto cell : coarseCellIdSets[elemIdx - blockStart])
+            cell->insert(cell->end(), elemIdx);
+          continue;
+        }
+        auto &sets = cellIdSets[elemIdx - blockStart];
+        for (size_t n = 0; n < (1 << D); n++) {
+          auto cell = sets[n];
+          if (cell == nullptr) {
+            psLogger::getInstance().addError("BVH building error.").print();
+          }
+          // neighboring corners are usually in the same bounding volume
+          if (std::find(sets.begin(), sets.begin() + n, cell) !=
+              sets.begin() + n)
+            continue;
+          // cells are inserted in ascending order
+          cell->insert(cell->end(), elemIdx);
+        }
+      }
+    }
+  }
+
+  // Bounding volumes of all grid points covered by a coarse cell.
+  void getCoarseCellIdSets(const size_t cellIdx,
+                           std::vector<std::set<csIndexType> *> &sets) {
+    const auto index = getCellIndex(cellIdx);
+    const unsigned numPoints = (1 << getCellLevel(cellIdx)) + 1;
+    unsigned totalPoints = 1;
+    for (int i = 0; i < D; ++i)
+      totalPoints *= numPoints;
+
+    sets.clear();
+    for (unsigned p = 0; p < totalPoints; ++p) {
+      std::array<T, 3> point = {0., 0., 0.};
+      for (unsigned i = 0, rest = p; i < D; ++i, rest /= numPoints)
+        point[i] = (index[i] + static_cast<hrleIndexType>(rest % numPoints)) *
+                   gridDelta;
+      auto cell = BVH->getCellIds(point);
+      if (cell == nullptr) {
+        psLogger::getInstance().addError("BVH building error.").print();
+      }
+      sets.push_back(cell);
+    }
+    std::sort(sets.begin(), sets.end());
+    sets.erase(std::unique(sets.begin(), sets.end()), sets.end());
+  }
+
+  // Merges aligned blocks of 2^D cells of the same material into a cell of
+  // the next level, level by level, if the block is far enough away from the
+  // surface. A merged cell takes the place and the scalar data of the cell at
+  // its lowest corner, so the cells stay in the order in which they were
+  // created.
+  void coarsenCells() {
+    using IndexType = hrleVectorType<hrleIndexType, D>;
+    auto &elems = cellGrid->template getElements<(1 << D)>();
+    auto &nodes = cellGrid->getNodes();
+    const auto materialIds = getScalarData("Material");
+    if (numberOfCells == 0 || materialIds == nullptr)
+      return;
+
+    struct Block {
+      IndexType index;
+      csIndexType cellId; // cell at the lowest corner
+      unsigned char level;
+    };
+    std::vector<Block> blocks(numberOfCells);
+    const long long numCells = numberOfCells;
+#pragma omp parallel for
+    for (long long i = 0; i < numCells; ++i) {
+      blocks[i] = Block{getCellIndex(i), static_cast<csIndexType>(i), 0};
+    }
+
+    auto findBlock = [&blocks](const IndexType &index) {
+      auto it = std::lower_bound(
+          blocks.begin(), blocks.end(), index,
+          [](const Block &block, const IndexType &value) {
+            return isBefore(block.index, value);
+          });
+      if (it != blocks.end() && !isBefore(index, it->index))
+        return static_cast<size_t>(it - blocks.begin());
+      return blocks.size();
+    };
+    auto getChildIndex = [](IndexType index, const unsigned child,
+                            const hrleIndexType childSize) {
+      for (unsigned i = 0; i < D; ++i)
+        index[i] += ((child >> i) & 1) ? childSize : 0;
+      return index;
+    };
+
+    auto heights = getSurfaceHeights();
+    hrleIndexType filterRadius = 0;
+    for (unsigned level = 1; level <= maxCellLevel; ++level) {
+      const hrleIndexType size = 1 << level;
+      const hrleIndexType childSize = size / 2;
+      // the defined points of the surface can be one grid point away from it
+      const hrleIndexType distance =
+          static_cast<hrleIndexType>(
+              std::ceil(coarseningDistance * childSize / gridDelta)) +
+          1;
+      minFilter(heights, distance - filterRadius);
+      filterRadius = distance;
+
+      const long long count = blocks.size();
+      std::vector<char> merge(blocks.size(), 0);
+#pragma omp parallel for
+      for (long long b = 0; b < count; ++b) {
+        const auto &block = blocks[b];
+        if (block.level != level - 1 || !isAligned(block.index, level) ||
+            !isFarFromSurface(heights, block.index, size, distance))
+          continue;
+        const auto material = materialIds->at(block.cellId);
+        bool mergeBlock = true;
+        for (unsigned child = 1; child < (1 << D) && mergeBlock; ++child) {
+          const auto c =
+              findBlock(getChildIndex(block.index, child, childSize));
+          mergeBlock = c < blocks.size() && blocks[c].level == level - 1 &&
+                       materialIds->at(blocks[c].cellId) == material;
         }
-        cell->insert(elemIdx);
+        merge[b] = mergeBlock;
       }
+
+      std::vector<char> removed(blocks.size(), 0);
+#pragma omp parallel for
+      for (long long b = 0; b < count; ++b) {
+        if (!merge[b])
+          continue;
+        for (unsigned child = 1; child < (1 << D); ++child)
+          removed[findBlock(getChildIndex(blocks[b].index, child,
+                                          childSize))] = 1;
+      }
+
+      size_t numBlocks = 0;
+      for (size_t b = 0; b < blocks.size(); ++b) {
+        if (removed[b])
+          continue;
+        blocks[numBlocks] = blocks[b];
+        if (merge[b])
+          blocks[numBlocks].level = level;
+        ++numBlocks;
+      }
+      if (numBlocks == blocks.size())
+        break;
+      blocks.resize(numBlocks);
+    }
+
+    if (blocks.size() == numberOfCells)
+      return;
+
+    // corners of an element relative to its lowest corner
+    std::array<IndexType, (1 << D)> cornerOffsets;
+    for (unsigned j = 0; j < (1 << D); ++j) {
+      for (unsigned i = 0; i < D; ++i)
+        cornerOffsets[j][i] = static_cast<hrleIndexType>(std::round(
+            (nodes[elems[0][j]][i] - nodes[elems[0][0]][i]) / gridDelta));
     }
+
+    // the corners of a coarse cell are corners of the cells of gridDelta at
+    // the corners of the block
+    std::vector<std::array<unsigned, (1 << D)>> newElems(blocks.size());
+    std::vector<csIndexType> newIndices(numberOfCells, -1);
+    cellLevels.resize(blocks.size());
+    const long long count = blocks.size();
+#pragma omp parallel for
+    for (long long b = 0; b < count; ++b) {
+      const auto &block = blocks[b];
+      newIndices[block.cellId] = b;
+      cellLevels[b] = block.level;
+      newElems[b] = elems[block.cellId];
+      const hrleIndexType size = 1 << block.level;
+      for (unsigned j = 1; block.level > 0 && j < (1 << D); ++j) {
+        auto cornerIndex = block.index;
+        for (unsigned i = 0; i < D; ++i)
+          cornerIndex[i] += cornerOffsets[j][i] * (size - 1);
+        newElems[b][j] = elems[findCell(cornerIndex)][j];
+      }
+    }
+
+    {
+      std::vector<T> buffer;
+      auto numScalarData = cellGrid->getCellData().getScalarDataSize();
+      for (int i = 0; i < numScalarData; i++) {
+        auto data = cellGrid->getCellData().getScalarData(i);
+        csUtil::compact(*data, buffer, newIndices, blocks.size());
+      }
+    }
+
+    // remove the nodes inside of the coarse cells
+    std::vector<char> usedNodes(nodes.size(), 0);
+    for (const auto &elem : newElems) {
+      for (const auto n : elem)
+        usedNodes[n] = 1;
+    }
+    std::vector<csIndexType> newNodeIndices(nodes.size());
+    const auto numNodes = csUtil::compactionIndices(
+        newNodeIndices, [&usedNodes](size_t i) { return usedNodes[i] != 0; });
+    {
+      std::vector<std::array<T, 3>> buffer;
+      csUtil::compact(nodes, buffer, newNodeIndices, numNodes);
+    }
+#pragma omp parallel for
+    for (long long b = 0; b < count; ++b) {
+      for (auto &n : newElems[b])
+        n = newNodeIndices[n];
+    }
+
+    elems.swap(newElems);
+    numberOfCells = elems.size();
+  }
+
+  static bool isAligned(const hrleVectorType<hrleIndexType, D> &index,
+                        const unsigned level) {
+    const hrleIndexType size = 1 << level;
+    for (unsigned i = 0; i < D; ++i) {
+      if (index[i] % size != 0)
+        return false;
+    }
+    return true;
+  }
+
+  // Returns for each column of the grid along the last dimension the lowest
+  // defined point of the surface, or the negative of the highest one if the
+  // cell set is above the surface. Columns without surface points get the
+  // largest index.
+  std::vector<hrleIndexType> getSurfaceHeights() const {
+    size_t numColumns = 1;
+    for (int i = 0; i < D - 1; ++i)
+      numColumns *= maxIndex[i] - minIndex[i] + 1;
+    std::vector<hrleIndexType> heights(
+        numColumns, std::numeric_limits<hrleIndexType>::max());
+    const hrleIndexType sign = cellSetAboveSurface ? -1 : 1;
+
+    for (hrleConstSparseIterator<typename lsDomain<T, D>::DomainType> it(
+             surface->getDomain());
+         !it.isFinished(); ++it) {
+      if (!it.isDefined())
+        continue;
+      const auto index = it.getStartIndices();
+      size_t column = 0, stride = 1;
+      bool inside = true;
+      for (int i = 0; i < D - 1; ++i) {
+        const hrleIndexType extent = maxIndex[i] - minIndex[i] + 1;
+        const hrleIndexType position = index[i] - minIndex[i];
+        inside = inside && position >= 0 && position < extent;
+        column += position * stride;
+        stride *= extent;
+      }
+      if (inside)
+        heights[column] = std::min(heights[column], sign * index[D - 1]);
+    }
+    return heights;
+  }
+
+  // Replaces each height by the minimum over all columns within the radius.
+  void minFilter(std::vector<hrleIndexType> &heights,
+                 const hrleIndexType radius) const {
+    if (radius <= 0)
+      return;
+    std::vector<hrleIndexType> buffer(heights.size());
+    const long long count = heights.size();
+    long long stride = 1;
+    for (int i = 0; i < D - 1; ++i) {
+      const hrleIndexType extent = maxIndex[i] - minIndex[i] + 1;
+#pragma omp parallel for
+      for (long long c = 0; c < count; ++c) {
+        const hrleIndexType position = (c / stride) % extent;
+        const long long lineStart = c - position * stride;
+        const hrleIndexType end = std::min(position + radius, extent - 1);
+        auto value = heights[c];
+        for (hrleIndexType p = std::max(position - radius, hrleIndexType(0));
+             p <= end; ++p)
+          value = std::min(value, heights[lineStart + p * stride]);
+        buffer[c] = value;
+      }
+      heights.swap(buffer);
+      stride *= extent;
+    }
+  }
+
+  // Whether a block of cells is at least distance grid points away from the
+  // surface heights of all columns it covers.
+  bool isFarFromSurface(const std::vector<hrleIndexType> &heights,
+                        const hrleVectorType<hrleIndexType, D> &index,
+                        const hrleIndexType size,
+                        const hrleIndexType distance) const {
+    const hrleIndexType coordinate =
+        cellSetAboveSurface ? -index[D - 1] : index[D - 1] + size;
+    hrleIndexType numColumns = 1;
+    for (int i = 0; i < D - 1; ++i)
+      numColumns *= size;
+
+    for (hrleIndexType c = 0; c < numColumns; ++c) {
+      size_t column = 0, stride = 1;
+      bool inside = true;
+      for (int i = 0, rest = c; i < D - 1; ++i, rest /= size) {
+        const hrleIndexType extent = maxIndex[i] - minIndex[i] + 1;
+        const hrleIndexType position = index[i] + rest % size - minIndex[i];
+        inside = inside && position >= 0 && position < extent;
+        column += position * stride;
+        stride *= extent;
+      }
+      if (inside && coordinate + distance > heights[column])
+        return false;
+    }
+    return true;
+  }
+
+  static bool isSameGrid(const typename lsDomain<T, D>::GridType &a,
+                         const typename lsDomain<T, D>::GridType &b) {
+    if (a.getGridDelta() != b.getGridDelta())
+      return false;
+    for (unsigned i = 0; i < D; ++i) {
+      if (a.getMinBounds(i) != b.getMinBounds(i) ||
+          a.getMaxBounds(i) != b.getMaxBounds(i) ||
+          a.getBoundaryConditions(i) != b.getBoundaryConditions(i))
+        return false;
+    }
+    return true;
   }
 
   void calculateMinMaxIndex(
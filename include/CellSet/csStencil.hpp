@@ -0,0 +1,308 @@
+#pragma once
+
+#include <csDenseCellSet.hpp>
+
+#include <psLogger.hpp>
+#include <psSmartPointer.hpp>
+
+/// Stencil operations on scalar cell data of a dense cell set. The stencil of
+/// each cell consists of the cell itself and its 2*D face neighbors, which
+/// are taken from the neighborhood of the cell set. A mask can be set to
+/// restrict the operation to a subset of the cells: masked cells are neither
+/// updated nor used as neighbors. Each iteration reads the values of the
+/// previous iteration, the result is written to a second buffer. If the cell
+/// set contains coarse cells, the diffusion operators weight each pair of
+/// neighbors by the area of their common face and the distance of their
+/// centers, and include all cells on the faces of a coarse cell.
+template <class T, int D> class csStencil {
+  using NeighborType = std::array<csIndexType, 2 * D>;
+
+  psSmartPointer<csDenseCellSet<T, D>> cellSet = nullptr;
+  // neighbors of each cell, masked neighbors are set to -1
+  std::vector<NeighborType> neighbors;
+  std::vector<char> active;
+  std::vector<csIndexType> activeCells;
+  std::vector<T> buffer;
+  // Finer cells on the faces of coarse cells, which are not part of the
+  // neighbors of the coarse cell, in compressed row format.
+  std::vector<size_t> extraOffsets;
+  std::vector<csIndexType> extraNeighbors;
+  // work vectors of implicitLaplacian, kept between the calls
+  std::vector<T> residual;
+  std::vector<T> precond;
+  std::vector<T> direction;
+  std::vector<T> product;
+  std::vector<T> diagonal;
+
+public:
+  csStencil(psSmartPointer<csDenseCellSet<T, D>> passedCellSet)
+      : cellSet(passedCellSet) {
+    setMask([](size_t) { return true; });
+  }
+
+  // Only cells for which isActive(cellIdx) returns true are part of the
+  // stencil.
+  template <class MaskFunction> void setMask(MaskFunction isActive) {
+    const auto numCells = cellSet->getNumberOfCells();
+    const auto &cellNeighbors = cellSet->getNeighborhood();
+    active.resize(numCells);
+    neighbors.resize(numCells);
+    const long long count = numCells;
+
+#pragma omp parallel for
+    for (long long i = 0; i < count; i++) {
+      active[i] = isActive(i);
+    }
+
+    activeCells.clear();
+    for (size_t i = 0; i < numCells; i++) {
+      if (active[i])
+        activeCells.push_back(i);
+    }
+
+#pragma omp parallel for
+    for (long long i = 0; i < count; i++) {
+      for (int n = 0; n < 2 * D; n++) {
+        const auto neighbor = cellNeighbors[i][n];
+        neighbors[i][n] = (neighbor >= 0 && active[neighbor]) ? neighbor : -1;
+      }
+    }
+
+    // the links of the finer cells are added to the coarse cells, so that
+    // each pair of neighbors is coupled in both directions
+    extraOffsets.clear();
+    extraNeighbors.clear();
+    if (cellSet->hasCoarseCells()) {
+      std::vector<std::pair<csIndexType, csIndexType>> links;
+      for (size_t i = 0; i < numCells; i++) {
+        for (const auto n : neighbors[i]) {
+          if (n >= 0 && std::find(neighbors[n].begin(), neighbors[n].end(),
+                                  static_cast<csIndexType>(i)) ==
+                            neighbors[n].end())
+            links.emplace_back(n, i);
+        }
+      }
+      std::sort(links.begin(), links.end());
+      extraOffsets.assign(numCells + 1, 0);
+      extraNeighbors.reserve(links.size());
+      for (const auto &link : links) {
+        extraOffsets[link.first + 1]++;
+        extraNeighbors.push_back(link.second);
+      }
+      for (size_t i = 0; i < numCells; i++)
+        extraOffsets[i + 1] += extraOffsets[i];
+    }
+  }
+
+  // Restrict the stencil to cells of one material.
+  void setMaterialMask(const int materialId) {
+    const auto &materialIds = cellSet->getMaterialIds();
+    setMask([&materialIds, materialId](size_t i) {
+      return materialIds[i] == materialId;
+    });
+  }
+
+  bool isActive(const size_t cellIdx) const { return active[cellIdx]; }
+
+  // Neighbors of a cell in the order -x, x, -y, y, -z, z. Neighbors which do
+  // not exist or are masked are -1.
+  const NeighborType &getNeighbors(const size_t cellIdx) const {
+    return neighbors[cellIdx];
+  }
+
+  // Calls function(neighbor) for all active neighbors of a cell, including
+  // the finer cells on the faces of a coarse cell.
+  template <class NeighborFunction>
+  void forEachNeighbor(const size_t cellIdx, NeighborFunction function) const {
+    for (const auto n : neighbors[cellIdx]) {
+      if (n >= 0)
+        function(n);
+    }
+    if (!extraOffsets.empty()) {
+      for (auto k = extraOffsets[cellIdx]; k < extraOffsets[cellIdx + 1]; k++)
+        function(extraNeighbors[k]);
+    }
+  }
+
+  // Replaces each active cell by kernel(cellIdx, data, neighbors), which has
+  // to return the new value of the cell from the values of the previous
+  // iteration. Inactive cells keep their value. Only one neighbor per face is
+  // passed to the kernel, see forEachNeighbor.
+  template <class KernelFunction>
+  void apply(std::vector<T> &data, KernelFunction kernel,
+             const unsigned iterations = 1) {
+    assert(data.size() == active.size() && "Data incompatible");
+    buffer.resize(data.size());
+    const long long n = data.size();
+
+    for (unsigned it = 0; it < iterations; it++) {
+      const std::vector<T> &values = data;
+#pragma omp parallel for
+      for (long long i = 0; i < n; i++) {
+        buffer[i] =
+            active[i] ? T(kernel(i, values, neighbors[i])) : values[i];
+      }
+      data.swap(buffer);
+    }
+  }
+
+  // Replaces each active cell by the mean of itself and its active neighbors.
+  void average(std::vector<T> &data, const unsigned iterations = 1) {
+    apply(
+        data,
+        [this](size_t i, const std::vector<T> &values, const NeighborType &) {
+          T sum = values[i];
+          int numValues = 1;
+          forEachNeighbor(i, [&](csIndexType n) {
+            sum += values[n];
+            numValues++;
+          });
+          return sum / static_cast<T>(numValues);
+        },
+        iterations);
+  }
+
+  // Explicit diffusion steps u += factor * sum_n (u_n - u), with
+  // factor = dt * diffusionCoefficient / gridDelta^2. Missing and masked
+  // neighbors act as zero flux boundaries. The steps are stable for
+  // factor < 1 / (2 * D). For coarse cells the differences are weighted by
+  // the coupling c_n of the neighbors and divided by the volume V of the
+  // cell, both in units of gridDelta.
+  void laplacian(std::vector<T> &data, const T factor,
+                 const unsigned iterations = 1) {
+    apply(
+        data,
+        [this, factor](size_t i, const std::vector<T> &values,
+                       const NeighborType &) {
+          T sum = 0.;
+          forEachNeighbor(i, [&](csIndexType n) {
+            sum += getCoupling(i, n) * (values[n] - values[i]);
+          });
+          return values[i] + factor * sum / getVolume(i);
+        },
+        iterations);
+  }
+
+  // Implicit (backward Euler) diffusion step: solves
+  // u_new - factor * sum_n (u_new_n - u_new) = u for the active cells, which
+  // is stable for any factor. Coarse cells are weighted as in laplacian, the
+  // total amount sum V * u is conserved. The system is symmetric positive
+  // definite and is solved matrix-free with a Jacobi preconditioned conjugate
+  // gradient method, starting from the current values. The iteration stops
+  // once the residual is reduced by tolerance relative to the right hand
+  // side. Returns the number of iterations, a warning is printed if the
+  // tolerance is not reached within maxIterations.
+  unsigned implicitLaplacian(std::vector<T> &data, const T factor,
+                             const T tolerance = 1e-6,
+                             const unsigned maxIterations = 1000) {
+    assert(data.size() == active.size() && "Data incompatible");
+    const long long numActive = activeCells.size();
+    if (numActive == 0)
+      return 0;
+
+    // only the entries of the active cells are used
+    residual.resize(data.size());
+    precond.resize(data.size());
+    direction.resize(data.size());
+    product.resize(data.size());
+    diagonal.resize(data.size());
+
+    // A * x = V * x + factor * sum_n c_n * (x - x_n), with the volume V of
+    // the cell and the coupling c_n to its neighbors
+    auto multiply = [this, factor, numActive](const std::vector<T> &x,
+                                               std::vector<T> &result) {
+#pragma omp parallel for
+      for (long long k = 0; k < numActive; k++) {
+        const auto i = activeCells[k];
+        T sum = 0.;
+        forEachNeighbor(i, [&](csIndexType n) {
+          sum += getCoupling(i, n) * (x[i] - x[n]);
+        });
+        result[i] = getVolume(i) * x[i] + factor * sum;
+      }
+    };
+
+    // V * u is the right hand side, u the initial guess
+    T rhsNorm = 0.;
+    T rz = 0.;
+    multiply(data, product);
+#pragma omp parallel for reduction(+ : rhsNorm, rz)
+    for (long long k = 0; k < numActive; k++) {
+      const auto i = activeCells[k];
+      T coupling = 0.;
+      forEachNeighbor(i, [&](csIndexType n) { coupling += getCoupling(i, n); });
+      diagonal[i] = getVolume(i) + factor * coupling;
+      const T rhs = getVolume(i) * data[i];
+      rhsNorm += rhs * rhs;
+      residual[i] = rhs - product[i];
+      precond[i] = residual[i] / diagonal[i];
+      direction[i] = precond[i];
+      rz += residual[i] * precond[i];
+    }
+
+    const T threshold = tolerance * tolerance * rhsNorm;
+    unsigned iteration = 0;
+    bool converged = false;
+    for (;; iteration++) {
+      T residualNorm = 0.;
+#pragma omp parallel for reduction(+ : residualNorm)
+      for (long long k = 0; k < numActive; k++) {
+        const auto i = activeCells[k];
+        residualNorm += residual[i] * residual[i];
+      }
+      converged = residualNorm <= threshold;
+      if (converged || iteration == maxIterations)
+        break;
+
+      multiply(direction, product);
+      T pAp = 0.;
+#pragma omp parallel for reduction(+ : pAp)
+      for (long long k = 0; k < numActive; k++) {
+        const auto i = activeCells[k];
+        pAp += direction[i] * product[i];
+      }
+      const T alpha = rz / pAp;
+
+      T rzNew = 0.;
+#pragma omp parallel for reduction(+ : rzNew)
+      for (long long k = 0; k < numActive; k++) {
+        const auto i = activeCells[k];
+        data[i] += alpha * direction[i];
+        residual[i] -= alpha * product[i];
+        precond[i] = residual[i] / diagonal[i];
+        rzNew += residual[i] * precond[i];
+      }
+
+      const T beta = rzNew / rz;
+      rz = rzNew;
+#pragma omp parallel for
+      for (long long k = 0; k < numActive; k++) {
+        const auto i = activeCells[k];
+        direction[i] = precond[i] + beta * direction[i];
+      }
+    }
+
+    if (!converged) {
+      psLogger::getInstance()
+          .addWarning("csStencil: implicit diffusion did not converge within " +
+                      std::to_string(maxIterations) + " iterations.")
+          .print();
+    }
+
+    return iteration;
+  }
+
+private:
+  // Area of the common face of two cells divided by the distance of their
+  // centers, in units of gridDelta.
+  T getCoupling(const size_t i, const size_t n) const {
+    const T sizeI = 1 << cellSet->getCellLevel(i);
+    const T sizeN = 1 << cellSet->getCellLevel(n);
+    return std::pow(std::min(sizeI, sizeN), D - 1) * 2. / (sizeI + sizeN);
+  }
+
+  // Volume of a cell in units of gridDelta^D.
+  T getVolume(const size_t i) const {
+    return static_cast<T>(size_t(1) << (D * cellSet->getCellLevel(i)));
+  }
+};
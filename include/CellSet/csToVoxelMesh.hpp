@@ -0,0 +1,414 @@
+#pragma once
+
+#include <cmath>
+#include <omp.h>
+#include <unordered_map>
+
+#include <hrleDenseCellIterator.hpp>
+#include <hrleSparseIterator.hpp>
+
+#include <lsDomain.hpp>
+#include <lsExpand.hpp>
+#include <lsMesh.hpp>
+
+#include <psLogger.hpp>
+#include <psSmartPointer.hpp>
+
+/// Creates a voxel mesh from the passed level sets in the same way as
+/// lsToVoxelMesh: each cell is assigned to the first level set containing it
+/// and nodes and cells are numbered in the same order. The domain is split
+/// into slabs along the last dimension, which are voxelized in parallel.
+/// If a narrow band is set, only cells close to the band surface are
+/// created, so the cost scales with the surface area instead of the volume.
+template <class T, int D> class csToVoxelMesh {
+  using DomainType = typename lsDomain<T, D>::DomainType;
+  using IndexType = hrleVectorType<hrleIndexType, D>;
+  using ElementType = std::array<unsigned, (1 << D)>;
+
+  // Voxels of a range of slabs. Node ids are local to the chunk.
+  struct Chunk {
+    std::unordered_map<IndexType, unsigned, typename IndexType::hash> nodeIds;
+    std::vector<IndexType> nodes;
+    std::vector<ElementType> elements;
+    std::vector<T> materialIds;
+    // lowest slab of the chunk, its nodes might belong to the previous chunk
+    hrleIndexType firstSlab = 0;
+    // local node id -> (local node id in previous chunk)
+    std::vector<std::pair<unsigned, unsigned>> sharedNodes;
+    std::vector<unsigned> globalNodeIds;
+    size_t numNewNodes = 0;
+    size_t nodeOffset = 0;
+    size_t elementOffset = 0;
+  };
+
+  std::vector<psSmartPointer<lsDomain<T, D>>> levelSets;
+  psSmartPointer<lsMesh<T>> mesh = nullptr;
+  psSmartPointer<lsDomain<T, D>> bandSurface = nullptr;
+  T bandWidth = 0.;
+
+public:
+  csToVoxelMesh() {}
+
+  csToVoxelMesh(psSmartPointer<lsMesh<T>> passedMesh) : mesh(passedMesh) {}
+
+  csToVoxelMesh(
+      const std::vector<psSmartPointer<lsDomain<T, D>>> &passedLevelSets,
+      psSmartPointer<lsMesh<T>> passedMesh)
+      : levelSets(passedLevelSets), mesh(passedMesh) {}
+
+  void insertNextLevelSet(psSmartPointer<lsDomain<T, D>> passedLevelSet) {
+    levelSets.push_back(passedLevelSet);
+  }
+
+  void setMesh(psSmartPointer<lsMesh<T>> passedMesh) { mesh = passedMesh; }
+
+  // Only create cells whose lowest corner is at most width away from the
+  // surface. Cells are still numbered in the same order, but the node order
+  // differs from lsToVoxelMesh.
+  void setNarrowBand(psSmartPointer<lsDomain<T, D>> passedSurface,
+                     const T width) {
+    bandSurface = passedSurface;
+    bandWidth = width;
+  }
+
+  void apply() {
+    if (levelSets.empty()) {
+      psLogger::getInstance()
+          .addWarning("No level sets were passed to csToVoxelMesh.")
+          .print();
+      return;
+    }
+    if (mesh == nullptr) {
+      psLogger::getInstance()
+          .addWarning("No mesh was passed to csToVoxelMesh.")
+          .print();
+      return;
+    }
+
+    mesh->clear();
+    const auto gridDelta = levelSets.back()->getGrid().getGridDelta();
+
+    IndexType minIndex, maxIndex;
+    calculateBounds(minIndex, maxIndex);
+
+    if (bandSurface != nullptr) {
+      voxelizeNarrowBand(minIndex, maxIndex);
+      for (unsigned i = 0; i < D; ++i) {
+        mesh->minimumExtent[i] = gridDelta * minIndex[i];
+        mesh->maximumExtent[i] = gridDelta * maxIndex[i];
+      }
+      return;
+    }
+
+    // Cells in the slab at maxIndex[D - 1] are always outside the bounds,
+    // but are visited by the last chunk, since lsToVoxelMesh creates nodes
+    // for their lower corners.
+    const hrleIndexType numSlabs = maxIndex[D - 1] - minIndex[D - 1];
+    const int numChunks = std::max(
+        1, std::min<int>(omp_get_max_threads(), std::max(numSlabs, 1)));
+    std::vector<Chunk> chunks(numChunks);
+
+#pragma omp parallel for schedule(static, 1)
+    for (int c = 0; c < numChunks; ++c) {
+      auto &chunk = chunks[c];
+      chunk.firstSlab = minIndex[D - 1] + numSlabs * c / numChunks;
+      voxelizeChunk(chunk, c == 0, minIndex, maxIndex,
+                    (c + 1 == numChunks)
+                        ? maxIndex[D - 1] + 1
+                        : minIndex[D - 1] + numSlabs * (c + 1) / numChunks);
+    }
+
+    // Nodes in the lowest slab of a chunk were already created by the
+    // previous chunk if they are corners of its cells.
+#pragma omp parallel for
+    for (int c = 0; c < numChunks; ++c) {
+      auto &chunk = chunks[c];
+      chunk.globalNodeIds.resize(chunk.nodes.size());
+      chunk.numNewNodes = chunk.nodes.size();
+      if (c == 0)
+        continue;
+      const auto &prevIds = chunks[c - 1].nodeIds;
+      for (unsigned i = 0; i < chunk.nodes.size(); ++i) {
+        if (chunk.nodes[i][D - 1] != chunk.firstSlab)
+          continue;
+        auto it = prevIds.find(chunk.nodes[i]);
+        if (it != prevIds.end()) {
+          chunk.sharedNodes.emplace_back(i, it->second);
+          --chunk.numNewNodes;
+        }
+      }
+    }
+
+    size_t numNodes = 0;
+    size_t numElements = 0;
+    for (auto &chunk : chunks) {
+      chunk.nodeOffset = numNodes;
+      chunk.elementOffset = numElements;
+      numNodes += chunk.numNewNodes;
+      numElements += chunk.elements.size();
+    }
+
+    // New nodes are numbered in the order in which they were created. The
+    // shared nodes are never shared with an earlier chunk again, since each
+    // chunk contains at least one slab.
+#pragma omp parallel for
+    for (int c = 0; c < numChunks; ++c) {
+      auto &chunk = chunks[c];
+      auto shared = chunk.sharedNodes.begin();
+      size_t nodeId = chunk.nodeOffset;
+      for (unsigned i = 0; i < chunk.nodes.size(); ++i) {
+        if (shared != chunk.sharedNodes.end() && shared->first == i) {
+          ++shared;
+          continue;
+        }
+        chunk.globalNodeIds[i] = nodeId++;
+      }
+    }
+
+    auto &nodes = mesh->getNodes();
+    auto &elements = mesh->template getElements<(1 << D)>();
+    std::vector<T> materialIds(numElements);
+    nodes.resize(numNodes);
+    elements.resize(numElements);
+
+#pragma omp parallel for
+    for (int c = 0; c < numChunks; ++c) {
+      auto &chunk = chunks[c];
+      for (const auto &shared : chunk.sharedNodes)
+        chunk.globalNodeIds[shared.first] =
+            chunks[c - 1].globalNodeIds[shared.second];
+
+      auto shared = chunk.sharedNodes.begin();
+      for (unsigned i = 0; i < chunk.nodes.size(); ++i) {
+        if (shared != chunk.sharedNodes.end() && shared->first == i) {
+          ++shared;
+          continue;
+        }
+        std::array<T, 3> coords{};
+        for (unsigned j = 0; j < D; ++j)
+          coords[j] = gridDelta * chunk.nodes[i][j];
+        nodes[chunk.globalNodeIds[i]] = coords;
+      }
+
+      for (size_t e = 0; e < chunk.elements.size(); ++e) {
+        auto &element = elements[chunk.elementOffset + e];
+        for (unsigned n = 0; n < (1 << D); ++n)
+          element[n] = chunk.globalNodeIds[chunk.elements[e][n]];
+        materialIds[chunk.elementOffset + e] = chunk.materialIds[e];
+      }
+    }
+
+    mesh->getCellData().insertNextScalarData(std::move(materialIds),
+                                             "Material");
+
+    for (unsigned i = 0; i < D; ++i) {
+      mesh->minimumExtent[i] = gridDelta * minIndex[i];
+      mesh->maximumExtent[i] = gridDelta * maxIndex[i];
+    }
+  }
+
+private:
+  // Voxelizes all cells from the first slab of the chunk up to, but
+  // excluding, endSlab. The iterators are moved in the same way as in
+  // lsToVoxelMesh, so the cells of each chunk are visited in the same order.
+  void voxelizeChunk(Chunk &chunk, const bool isFirstChunk,
+                     const IndexType &minIndex, const IndexType &maxIndex,
+                     const hrleIndexType endSlab) {
+    // Start in the previous slab and let the iterator wrap around into the
+    // first slab of the chunk, so it starts at the same index as it would
+    // when iterating over the whole domain.
+    IndexType startIndex = minIndex;
+    if (!isFirstChunk)
+      startIndex[D - 1] = chunk.firstSlab - 1;
+
+    std::vector<hrleConstDenseCellIterator<DomainType>> iterators;
+    iterators.reserve(levelSets.size());
+    iterators.emplace_back(levelSets.front()->getDomain(), startIndex);
+    auto &frontIt = iterators.front();
+    if (!isFirstChunk) {
+      while (frontIt.getIndices(D - 1) < chunk.firstSlab)
+        frontIt.next();
+    }
+    for (unsigned l = 1; l < levelSets.size(); ++l)
+      iterators.emplace_back(levelSets[l]->getDomain(), frontIt.getIndices());
+
+    for (; frontIt.getIndices() < maxIndex &&
+           frontIt.getIndices(D - 1) < endSlab;
+         frontIt.next()) {
+      // go over all materials
+      for (unsigned materialId = 0; materialId < levelSets.size();
+           ++materialId) {
+        auto &cellIt = iterators[materialId];
+        cellIt.goToIndicesSequential(frontIt.getIndices());
+
+        // find out whether the centre of the box is inside
+        T centerValue = 0.;
+        for (int i = 0; i < (1 << D); ++i) {
+          centerValue += cellIt.getCorner(i).getValue();
+        }
+
+        if (centerValue <= 0.) {
+          std::array<unsigned, (1 << D)> voxel;
+          bool addVoxel = true;
+          // check if voxel is in bounds
+          for (unsigned i = 0; i < (1 << D); ++i) {
+            IndexType index;
+            for (unsigned j = 0; j < D; ++j) {
+              index[j] =
+                  cellIt.getIndices(j) + cellIt.getCorner(i).getOffset()[j];
+              if (index[j] > maxIndex[j]) {
+                addVoxel = false;
+                break;
+              }
+            }
+            if (!addVoxel)
+              break;
+
+            auto nodeId = chunk.nodeIds.insert(
+                std::make_pair(index, unsigned(chunk.nodes.size())));
+            if (nodeId.second)
+              chunk.nodes.push_back(index);
+            voxel[i] = nodeId.first->second;
+          }
+
+          if (addVoxel) {
+            if constexpr (D == 3) {
+              chunk.elements.push_back(ElementType{voxel[0], voxel[1],
+                                                   voxel[3], voxel[2],
+                                                   voxel[4], voxel[5],
+                                                   voxel[7], voxel[6]});
+            } else {
+              chunk.elements.push_back(
+                  ElementType{voxel[0], voxel[2], voxel[3], voxel[1]});
+            }
+            chunk.materialIds.push_back(materialId);
+          }
+
+          // jump out of material for loop
+          break;
+        }
+      }
+    }
+  }
+
+  void voxelizeNarrowBand(const IndexType &minIndex,
+                          const IndexType &maxIndex) {
+    const auto gridDelta = levelSets.back()->getGrid().getGridDelta();
+    const T maxValue = bandWidth / gridDelta;
+
+    // the level set values of the expanded surface are the distances in
+    // grid units
+    auto band = psSmartPointer<lsDomain<T, D>>::New(bandSurface);
+    lsExpand<T, D>(band, 2 * static_cast<int>(std::ceil(maxValue)) + 3)
+        .apply();
+
+    // defined points are visited in the order in which cells are created
+    std::vector<IndexType> cells;
+    for (hrleConstSparseIterator<DomainType> it(band->getDomain());
+         !it.isFinished(); ++it) {
+      if (!it.isDefined() || std::abs(it.getValue()) > maxValue)
+        continue;
+      auto index = it.getStartIndices();
+      bool inside = true;
+      for (unsigned j = 0; j < D; ++j) {
+        if (index[j] < minIndex[j] || index[j] >= maxIndex[j])
+          inside = false;
+      }
+      if (inside)
+        cells.push_back(index);
+    }
+
+    // the first material which contains the cell
+    std::vector<int> cellMaterials(cells.size(), -1);
+#pragma omp parallel
+    {
+      const int numThreads = omp_get_num_threads();
+      const int threadNum = omp_get_thread_num();
+      const size_t begin = cells.size() * threadNum / numThreads;
+      const size_t end = cells.size() * (threadNum + 1) / numThreads;
+
+      if (begin < end) {
+        std::vector<hrleConstDenseCellIterator<DomainType>> iterators;
+        for (auto &ls : levelSets)
+          iterators.emplace_back(ls->getDomain(), cells[begin]);
+
+        for (size_t c = begin; c < end; ++c) {
+          for (unsigned materialId = 0; materialId < iterators.size();
+               ++materialId) {
+            auto &cellIt = iterators[materialId];
+            cellIt.goToIndicesSequential(cells[c]);
+
+            T centerValue = 0.;
+            for (int i = 0; i < (1 << D); ++i) {
+              centerValue += cellIt.getCorner(i).getValue();
+            }
+
+            if (centerValue <= 0.) {
+              cellMaterials[c] = materialId;
+              break;
+            }
+          }
+        }
+      }
+    }
+
+    auto &nodes = mesh->getNodes();
+    auto &elements = mesh->template getElements<(1 << D)>();
+    std::vector<T> materialIds;
+    std::unordered_map<IndexType, unsigned, typename IndexType::hash> nodeIds;
+    for (size_t c = 0; c < cells.size(); ++c) {
+      if (cellMaterials[c] < 0)
+        continue;
+
+      std::array<unsigned, (1 << D)> voxel;
+      for (unsigned i = 0; i < (1 << D); ++i) {
+        IndexType index = cells[c];
+        for (unsigned j = 0; j < D; ++j)
+          index[j] += (i >> j) & 1;
+
+        auto nodeId =
+            nodeIds.insert(std::make_pair(index, unsigned(nodes.size())));
+        if (nodeId.second) {
+          std::array<T, 3> coords{};
+          for (unsigned j = 0; j < D; ++j)
+            coords[j] = gridDelta * index[j];
+          nodes.push_back(coords);
+        }
+        voxel[i] = nodeId.first->second;
+      }
+
+      if constexpr (D == 3) {
+        elements.push_back(ElementType{voxel[0], voxel[1], voxel[3], voxel[2],
+                                       voxel[4], voxel[5], voxel[7],
+                                       voxel[6]});
+      } else {
+        elements.push_back(
+            ElementType{voxel[0], voxel[2], voxel[3], voxel[1]});
+      }
+      materialIds.push_back(cellMaterials[c]);
+    }
+
+    mesh->getCellData().insertNextScalarData(std::move(materialIds),
+                                             "Material");
+  }
+
+  void calculateBounds(IndexType &minIndex, IndexType &maxIndex) const {
+    for (unsigned i = 0; i < D; ++i) {
+      minIndex[i] = std::numeric_limits<hrleIndexType>::max();
+      maxIndex[i] = std::numeric_limits<hrleIndexType>::lowest();
+    }
+    for (auto &ls : levelSets) {
+      auto &grid = ls->getGrid();
+      auto &domain = ls->getDomain();
+      for (unsigned i = 0; i < D; ++i) {
+        minIndex[i] = std::min(minIndex[i], (grid.isNegBoundaryInfinite(i))
+                                                ? domain.getMinRunBreak(i)
+                                                : grid.getMinBounds(i));
+
+        maxIndex[i] = std::max(maxIndex[i], (grid.isPosBoundaryInfinite(i))
+                                                ? domain.getMaxRunBreak(i)
+                                                : grid.getMaxBounds(i));
+      }
+    }
+  }
+};
@@ -2,19 +2,23 @@
 
 #include <unordered_map>
 
-template <class T> class csTracePath {
+#include <csUtil.hpp>
+
+// The grid data holds one value per cell of the cell set and is accumulated
+// separately by each thread, so it is stored in single precision by default.
+template <class T, class GridDataType = float> class csTracePath {
 private:
-  std::unordered_map<int, T> data;
-  std::vector<T> gridData;
+  std::unordered_map<csIndexType, T> data;
+  std::vector<GridDataType> gridData;
 
 public:
-  std::unordered_map<int, T> &getData() { return data; }
+  std::unordered_map<csIndexType, T> &getData() { return data; }
 
-  std::vector<T> &getGridData() { return gridData; }
+  std::vector<GridDataType> &getGridData() { return gridData; }
 
-  T getGridValue(int idx) const { return gridData[idx]; }
+  T getGridValue(csIndexType idx) const { return gridData[idx]; }
 
-  void addPoint(int idx, T value) {
+  void addPoint(csIndexType idx, T value) {
     auto search = data.find(idx);
     if (search != data.end()) {
       data[idx] += value;
@@ -31,7 +35,7 @@ public:
 
   void useGridData(size_t numCells) { gridData.resize(numCells, 0.); }
 
-  void addGridData(int idx, T value) { gridData[idx] += value; }
+  void addGridData(csIndexType idx, T value) { gridData[idx] += value; }
 
   void clear() {
     data.clear();
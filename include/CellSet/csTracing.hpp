@@ -3,23 +3,49 @@
 #include <embree3/rtcore.h>
 
 #include <csDenseCellSet.hpp>
+#include <csStencil.hpp>
 #include <csTracingKernel.hpp>
 #include <csTracingParticle.hpp>
 
 #include <lsToDiskMesh.hpp>
 
+#include <psRayDevice.hpp>
+
 #include <rayGeometry.hpp>
 #include <rayParticle.hpp>
 #include <raySourceRandom.hpp>
 #include <rayUtil.hpp>
 
+/// Statistics of the last call to csTracing::apply(). Errors are only
+/// estimated if a target relative error is set. The relative error is the
+/// standard error of the filling fractions of all active cells relative to
+/// the filling fractions, both measured in the L2 norm over these cells.
+template <class T> struct csTracingStatistics {
+  size_t numberOfBatches = 0;
+  size_t numberOfRays = 0;
+  size_t numberOfActiveCells = 0;
+  T relativeError = 0.;
+  T maxCellRelativeError = 0.;
+  bool converged = false;
+};
+
 template <class T, int D> class csTracing {
 private:
   lsSmartPointer<csDenseCellSet<T, D>> cellSet = nullptr;
   std::unique_ptr<csAbstractParticle<T>> mParticle = nullptr;
 
   RTCDevice mDevice;
+  RTCScene mScene;
   rayGeometry<T, D> mGeometry;
+  std::unique_ptr<rayBoundary<T, D>> mBoundary = nullptr;
+  rayPair<rayTriple<T>> mBoundingBox;
+  std::array<int, 5> mTraceSettings;
+  unsigned mGeometryID = RTC_INVALID_GEOMETRY_ID;
+  unsigned mBoundaryID = RTC_INVALID_GEOMETRY_ID;
+  bool mGeometryUpToDate = false;
+  // optional disk mesh of the surface provided by the caller (e.g. the mesh
+  // psProcess already extracted for the current step)
+  lsSmartPointer<lsMesh<T>> mDiskMesh = nullptr;
   size_t mNumberOfRaysPerPoint = 0;
   size_t mNumberOfRaysFixed = 1000;
   T mGridDelta = 0;
@@ -28,49 +54,81 @@ private:
   bool mUseRandomSeeds = true;
   size_t mRunNumber = 0;
   int excludeMaterialId = -1;
+  csPair<T> mWeightWindow = {0.25, 4.};
+  // rays are traced in batches until the relative error is reached
+  T mTargetRelativeError = 0.;
+  size_t mMaxNumberOfBatches = 100;
+  static constexpr size_t minNumberOfBatches = 4;
+  csTracingStatistics<T> mStatistics;
+  std::vector<T> mRelativeErrors;
 
 public:
-  csTracing() : mDevice(rtcNewDevice("hugepages=1")) {
+  csTracing()
+      : mDevice(psRayDevice::getInstance().acquire()),
+        mScene(rtcNewScene(mDevice)) {
     // TODO: currently only periodic boundary conditions are implemented in
     // csTracingKernel
     for (int i = 0; i < D; i++)
       mBoundaryConds[i] = rayTraceBoundary::PERIODIC;
+
+    rtcSetSceneFlags(mScene, RTC_SCENE_FLAG_NONE);
+    rtcSetSceneBuildQuality(mScene, RTC_BUILD_QUALITY_HIGH);
   }
 
+  csTracing(const csTracing &) = delete;
+  csTracing &operator=(const csTracing &) = delete;
+
   ~csTracing() {
-    mGeometry.releaseGeometry();
+    releaseGeometry();
+    rtcReleaseScene(mScene);
     rtcReleaseDevice(mDevice);
   }
 
   void apply() {
-    createGeometry();
+    if (!mGeometryUpToDate)
+      createGeometry();
     initMemoryFlags();
-    auto boundingBox = mGeometry.getBoundingBox();
-    rayInternal::adjustBoundingBox<T, D>(
-        boundingBox, mSourceDirection, mGridDelta * rayInternal::DiskFactor<D>);
-    auto traceSettings = rayInternal::getTraceSettings(mSourceDirection);
-
-    auto boundary =
-        rayBoundary<T, D>(mDevice, boundingBox, mBoundaryConds, traceSettings);
 
     auto raySource = raySourceRandom<T, D>(
-        boundingBox, mParticle->getSourceDistributionPower(), traceSettings,
+        mBoundingBox, mParticle->getSourceDistributionPower(), mTraceSettings,
         mGeometry.getNumPoints());
 
-    auto tracer = csTracingKernel<T, D>(
-        mDevice, mGeometry, boundary, raySource, mParticle,
-        mNumberOfRaysPerPoint, mNumberOfRaysFixed, mUseRandomSeeds,
-        mRunNumber++, cellSet, excludeMaterialId - 1);
-    tracer.apply();
+    mStatistics = csTracingStatistics<T>{};
+    if (mTargetRelativeError > 0.) {
+      traceBatches(raySource);
+    } else {
+      trace(raySource);
+      mRelativeErrors.clear();
+    }
 
     averageNeighborhood();
-    boundary.releaseGeometry();
+
+    // The geometry is only kept for the next call if it was provided from
+    // outside. Otherwise it is extracted from the level sets of the cell set
+    // again, since they might have changed in the meantime.
+    if (!mDiskMesh)
+      mGeometryUpToDate = false;
   }
 
   void setCellSet(lsSmartPointer<csDenseCellSet<T, D>> passedCellSet) {
     cellSet = passedCellSet;
+    mGeometryUpToDate = false;
   }
 
+  // Set the disk mesh of the surface which is used to build the tracing
+  // geometry, instead of extracting it from the level sets of the cell set.
+  // The mesh has to contain the "Normals" and "MaterialIds" cell data, as
+  // created by lsToDiskMesh. The geometry is kept across calls to apply()
+  // until a new mesh is passed or invalidateGeometry() is called.
+  void setDiskMesh(lsSmartPointer<lsMesh<T>> passedDiskMesh) {
+    mDiskMesh = passedDiskMesh;
+    mGeometryUpToDate = false;
+  }
+
+  // Mark the tracing geometry as outdated, e.g. if the content of the disk
+  // mesh passed with setDiskMesh() was updated in place.
+  void invalidateGeometry() { mGeometryUpToDate = false; }
+
   template <typename ParticleType>
   void setParticle(std::unique_ptr<ParticleType> &p) {
     static_assert(std::is_base_of<csAbstractParticle<T>, ParticleType>::value &&
@@ -90,123 +148,237 @@ public:
 
   void setExcludeMaterialId(int passedId) { excludeMaterialId = passedId; }
 
+  // Trace the rays in batches until the relative error of the filling
+  // fractions is below the target, but at most maxBatches batches. The number
+  // of rays set per point or in total is traced in each batch. A target of 0
+  // traces a single batch without error estimation.
+  void setTargetRelativeError(const T passedError,
+                              const size_t maxBatches = 100) {
+    mTargetRelativeError = passedError;
+    mMaxNumberOfBatches = std::max(maxBatches, minNumberOfBatches);
+  }
+
+  const csTracingStatistics<T> &getStatistics() const { return mStatistics; }
+
+  // Relative error of the filling fraction of each cell after the last
+  // batched tracing, 0 for inactive cells.
+  const std::vector<T> &getRelativeErrors() const { return mRelativeErrors; }
+
+  // Volume particles whose weight times importance is below lower are
+  // terminated by Russian roulette, the ones above upper are split. Setting
+  // a bound to 0 disables the respective technique.
+  void setWeightWindow(const T lower, const T upper) {
+    mWeightWindow = {lower, upper};
+  }
+
   lsSmartPointer<csDenseCellSet<T, D>> getCellSet() const { return cellSet; }
 
   void averageNeighborhood() {
     auto data = cellSet->getFillingFractions();
-    auto materialIds = cellSet->getScalarData("Material");
-    const auto &elems = cellSet->getElements();
-    const auto &nodes = cellSet->getNodes();
-    std::vector<T> average(data->size(), 0.);
+    const auto &materialIds = cellSet->getMaterialIds();
 
+    // cells without data are marked with -1, the excluded material is reset
+    const long long n = data->size();
 #pragma omp parallel for
-    for (size_t i = 0; i < data->size(); i++) {
-      if (data->at(i) < 0) {
-        average[i] = -1.;
-        continue;
-      }
-      if (materialIds->at(i) == excludeMaterialId)
-        continue;
-
-      int numNeighbors = 1;
-      average[i] += data->at(i);
-
-      for (int d = 0; d < D; d++) {
-        auto mid = calcMidPoint(nodes[elems[i][0]]);
-        mid[d] -= mGridDelta;
-        auto elemId = cellSet->getIndex(mid);
-        if (elemId >= 0) {
-          if (data->at(elemId) >= 0 &&
-              materialIds->at(elemId) != excludeMaterialId) {
-            average[i] += data->at(elemId);
-            numNeighbors++;
-          }
-        }
-
-        mid[d] += 2 * mGridDelta;
-        elemId = cellSet->getIndex(mid);
-        if (elemId >= 0) {
-          if (data->at(elemId) >= 0 &&
-              materialIds->at(elemId) != excludeMaterialId) {
-            average[i] += data->at(elemId);
-            numNeighbors++;
-          }
-        }
-      }
-      average[i] /= static_cast<T>(numNeighbors);
+    for (long long i = 0; i < n; i++) {
+      if (data->at(i) < 0)
+        data->at(i) = -1.;
+      else if (materialIds[i] == excludeMaterialId)
+        data->at(i) = 0.;
     }
 
-#pragma omp parallel for
-    for (size_t i = 0; i < data->size(); i++) {
-      data->at(i) = average[i];
-    }
+    csStencil<T, D> stencil(cellSet);
+    stencil.setMask([data, &materialIds, this](size_t i) {
+      return data->at(i) >= 0 && materialIds[i] != excludeMaterialId;
+    });
+    stencil.average(*data);
   }
 
   void averageNeighborhoodSingleMaterial(int materialId) {
     auto data = cellSet->getFillingFractions();
-    auto materialIds = cellSet->getScalarData("Material");
-    const auto &elems = cellSet->getElements();
-    const auto &nodes = cellSet->getNodes();
-    std::vector<T> average(data->size(), 0.);
+    const auto &materialIds = cellSet->getMaterialIds();
 
+    const long long n = data->size();
 #pragma omp parallel for
-    for (size_t i = 0; i < data->size(); i++) {
-      if (materialIds->at(i) != materialId)
-        continue;
+    for (long long i = 0; i < n; i++) {
+      if (materialIds[i] != materialId)
+        data->at(i) = 0.;
+    }
 
-      int numNeighbors = 1;
-      average[i] += data->at(i);
-      for (int d = 0; d < D; d++) {
-        auto mid = calcMidPoint(nodes[elems[i][0]]);
-        mid[d] -= mGridDelta;
-        auto elemId = cellSet->getIndex(mid);
-        if (elemId >= 0) {
-          if (data->at(elemId) >= 0 && materialIds->at(elemId) == materialId) {
-            average[i] += data->at(elemId);
-            numNeighbors++;
-          }
+    // the cell itself is always part of the average, its neighbors only if
+    // they contain data
+    csStencil<T, D> stencil(cellSet);
+    stencil.setMaterialMask(materialId);
+    stencil.apply(*data, [](size_t i, const std::vector<T> &values,
+                            const std::array<csIndexType, 2 * D> &neighbors) {
+      T sum = values[i];
+      int numValues = 1;
+      for (const auto n : neighbors) {
+        if (n >= 0 && values[n] >= 0) {
+          sum += values[n];
+          numValues++;
         }
+      }
+      return sum / static_cast<T>(numValues);
+    });
+  }
 
-        mid[d] += 2 * mGridDelta;
-        elemId = cellSet->getIndex(mid);
-        if (elemId >= 0) {
-          if (data->at(elemId) >= 0 && materialIds->at(elemId) == materialId) {
-            average[i] += data->at(elemId);
-            numNeighbors++;
-          }
-        }
+private:
+  void trace(raySource<T, D> &source) {
+    auto tracer = csTracingKernel<T, D>(
+        mDevice, mScene, mGeometry, mGeometryID, *mBoundary, mBoundaryID,
+        source, mParticle, mNumberOfRaysPerPoint, mNumberOfRaysFixed,
+        mUseRandomSeeds, mRunNumber++, cellSet, excludeMaterialId - 1,
+        mWeightWindow);
+    tracer.apply();
+
+    mStatistics.numberOfBatches++;
+    mStatistics.numberOfRays += mNumberOfRaysFixed == 0
+                                    ? source.getNumPoints() *
+                                          mNumberOfRaysPerPoint
+                                    : mNumberOfRaysFixed;
+  }
+
+  // Each batch gives an independent estimate of the filling fractions, the
+  // result is their mean and the error is estimated from their spread.
+  void traceBatches(raySource<T, D> &source) {
+    auto data = cellSet->getFillingFractions();
+    const long long numCells = data->size();
+    const std::vector<T> initialData(*data);
+    std::vector<T> sum(numCells, 0.);
+    std::vector<T> sumSquares(numCells, 0.);
+    mRelativeErrors.assign(numCells, 0.);
+
+    while (mStatistics.numberOfBatches < mMaxNumberOfBatches) {
+      std::fill(data->begin(), data->end(), T(0));
+      trace(source);
+#pragma omp parallel for
+      for (long long i = 0; i < numCells; i++) {
+        sum[i] += data->at(i);
+        sumSquares[i] += data->at(i) * data->at(i);
+      }
+
+      updateStatistics(sum, sumSquares);
+      if (mStatistics.numberOfBatches >= minNumberOfBatches &&
+          mStatistics.relativeError <= mTargetRelativeError) {
+        mStatistics.converged = true;
+        break;
       }
-      average[i] /= static_cast<T>(numNeighbors);
     }
 
+    const T numBatches = mStatistics.numberOfBatches;
 #pragma omp parallel for
-    for (size_t i = 0; i < data->size(); i++) {
-      data->at(i) = average[i];
+    for (long long i = 0; i < numCells; i++) {
+      data->at(i) = initialData[i] + sum[i] / numBatches;
+    }
+
+    psLogger::getInstance()
+        .addInfo("Volume tracing: " +
+                 std::to_string(mStatistics.numberOfBatches) + " batches, " +
+                 std::to_string(mStatistics.numberOfRays) + " rays, " +
+                 std::to_string(mStatistics.numberOfActiveCells) +
+                 " active cells, relative error " +
+                 std::to_string(mStatistics.relativeError) +
+                 " (max. cell " +
+                 std::to_string(mStatistics.maxCellRelativeError) + ")")
+        .print();
+    if (!mStatistics.converged) {
+      psLogger::getInstance()
+          .addWarning("Volume tracing did not reach the relative error " +
+                      std::to_string(mTargetRelativeError) + " within " +
+                      std::to_string(mMaxNumberOfBatches) + " batches.")
+          .print();
     }
   }
 
-private:
+  void updateStatistics(const std::vector<T> &sum,
+                        const std::vector<T> &sumSquares) {
+    const auto &materialIds = cellSet->getMaterialIds();
+    const T numBatches = mStatistics.numberOfBatches;
+    T errorSquares = 0.;
+    T valueSquares = 0.;
+    T maxError = 0.;
+    size_t numActive = 0;
+    const long long numCells = sum.size();
+
+#pragma omp parallel for reduction(+ : errorSquares, valueSquares, numActive) \
+    reduction(max : maxError)
+    for (long long i = 0; i < numCells; i++) {
+      if (sum[i] <= 0. || materialIds[i] == excludeMaterialId) {
+        mRelativeErrors[i] = 0.;
+        continue;
+      }
+      // variance of the mean of the batch results
+      const T mean = sum[i] / numBatches;
+      const T variance =
+          numBatches > 1
+              ? std::max(sumSquares[i] / numBatches - mean * mean, T(0)) /
+                    (numBatches - 1)
+              : mean * mean;
+      mRelativeErrors[i] = std::sqrt(variance) / mean;
+      errorSquares += variance;
+      valueSquares += mean * mean;
+      maxError = std::max(maxError, mRelativeErrors[i]);
+      numActive++;
+    }
+
+    mStatistics.numberOfActiveCells = numActive;
+    mStatistics.relativeError =
+        valueSquares > 0. ? std::sqrt(errorSquares / valueSquares) : 0.;
+    mStatistics.maxCellRelativeError = maxError;
+  }
+
   void createGeometry() {
     auto levelSets = cellSet->getLevelSets();
-    auto diskMesh = lsSmartPointer<lsMesh<T>>::New();
-    lsToDiskMesh<T, D> converter(diskMesh);
-    for (auto ls : *levelSets) {
-      converter.insertNextLevelSet(ls);
+    auto diskMesh = mDiskMesh;
+    if (!diskMesh) {
+      diskMesh = lsSmartPointer<lsMesh<T>>::New();
+      lsToDiskMesh<T, D> converter(diskMesh);
+      for (auto ls : *levelSets) {
+        converter.insertNextLevelSet(ls);
+      }
+      converter.apply();
     }
-    converter.apply();
-    auto points = diskMesh->getNodes();
-    auto normals = *diskMesh->getCellData().getVectorData("Normals");
-    auto materialIds = *diskMesh->getCellData().getScalarData("MaterialIds");
+    auto &points = diskMesh->getNodes();
+    auto &normals = *diskMesh->getCellData().getVectorData("Normals");
+    auto &materialIds = *diskMesh->getCellData().getScalarData("MaterialIds");
     mGridDelta = levelSets->back()->getGrid().getGridDelta();
+
+    // detach the old geometry before it is replaced, so the scene can be kept
+    releaseGeometry();
     mGeometry.initGeometry(mDevice, points, normals,
                            mGridDelta * rayInternal::DiskFactor<D>);
     mGeometry.setMaterialIds(materialIds);
+
+    mBoundingBox = mGeometry.getBoundingBox();
+    rayInternal::adjustBoundingBox<T, D>(
+        mBoundingBox, mSourceDirection,
+        mGridDelta * rayInternal::DiskFactor<D>);
+    mTraceSettings = rayInternal::getTraceSettings(mSourceDirection);
+    mBoundary = std::make_unique<rayBoundary<T, D>>(
+        mDevice, mBoundingBox, mBoundaryConds, mTraceSettings);
+
+    mBoundaryID = rtcAttachGeometry(mScene, mBoundary->getRTCGeometry());
+    mGeometryID = rtcAttachGeometry(mScene, mGeometry.getRTCGeometry());
+    assert(rtcGetDeviceError(mDevice) == RTC_ERROR_NONE &&
+           "Embree device error");
+    mGeometryUpToDate = true;
   }
 
-  inline csTriple<T> calcMidPoint(const csTriple<T> &minNode) {
-    return csTriple<T>{minNode[0] + mGridDelta / T(2),
-                       minNode[1] + mGridDelta / T(2),
-                       minNode[2] + mGridDelta / T(2)};
+  void releaseGeometry() {
+    if (mGeometryID != RTC_INVALID_GEOMETRY_ID) {
+      rtcDetachGeometry(mScene, mGeometryID);
+      mGeometryID = RTC_INVALID_GEOMETRY_ID;
+    }
+    if (mBoundaryID != RTC_INVALID_GEOMETRY_ID) {
+      rtcDetachGeometry(mScene, mBoundaryID);
+      mBoundaryID = RTC_INVALID_GEOMETRY_ID;
+    }
+    if (mBoundary) {
+      mBoundary->releaseGeometry();
+      mBoundary.reset();
+    }
+    mGeometry.releaseGeometry();
   }
 
   void initMemoryFlags() {
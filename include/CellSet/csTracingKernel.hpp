@@ -14,38 +14,39 @@
 
 template <typename T, int D> class csTracingKernel {
 public:
-  csTracingKernel(RTCDevice &pDevice, rayGeometry<T, D> &pRTCGeometry,
-                  rayBoundary<T, D> &pRTCBoundary, raySource<T, D> &pSource,
+  csTracingKernel(RTCDevice &pDevice, RTCScene &pScene,
+                  rayGeometry<T, D> &pRTCGeometry, const unsigned pGeometryID,
+                  rayBoundary<T, D> &pRTCBoundary, const unsigned pBoundaryID,
+                  raySource<T, D> &pSource,
                   std::unique_ptr<csAbstractParticle<T>> &pParticle,
                   const size_t pNumOfRayPerPoint, const size_t pNumOfRayFixed,
                   const bool pUseRandomSeed, const size_t pRunNumber,
                   lsSmartPointer<csDenseCellSet<T, D>> passedCellSet,
-                  int passedExclude)
-      : mDevice(pDevice), mGeometry(pRTCGeometry), mBoundary(pRTCBoundary),
-        mSource(pSource), mParticle(pParticle->clone()),
+                  int passedExclude,
+                  const csPair<T> passedWeightWindow = {0., 0.})
+      : mDevice(pDevice), mScene(pScene), mGeometry(pRTCGeometry),
+        mGeometryID(pGeometryID), mBoundary(pRTCBoundary),
+        mBoundaryID(pBoundaryID), mSource(pSource),
+        mParticle(pParticle->clone()),
         mNumRays(pNumOfRayFixed == 0
                      ? pSource.getNumPoints() * pNumOfRayPerPoint
                      : pNumOfRayFixed),
         mUseRandomSeeds(pUseRandomSeed), mRunNumber(pRunNumber),
         cellSet(passedCellSet), excludeMaterial(passedExclude),
-        mGridDelta(cellSet->getGridDelta()) {
+        mGridDelta(cellSet->getGridDelta()),
+        mWeightWindow(passedWeightWindow) {
     assert(rtcGetDeviceProperty(mDevice, RTC_DEVICE_PROPERTY_VERSION) >=
                30601 &&
            "Error: The minimum version of Embree is 3.6.1");
   }
 
   void apply() {
-    auto rtcScene = rtcNewScene(mDevice);
-    rtcSetSceneFlags(rtcScene, RTC_SCENE_FLAG_NONE);
-    auto bbquality = RTC_BUILD_QUALITY_HIGH;
-    rtcSetSceneBuildQuality(rtcScene, bbquality);
-    auto rtcGeometry = mGeometry.getRTCGeometry();
-    auto rtcBoundary = mBoundary.getRTCGeometry();
-
-    auto boundaryID = rtcAttachGeometry(rtcScene, rtcBoundary);
-    auto geometryID = rtcAttachGeometry(rtcScene, rtcGeometry);
-    assert(rtcGetDeviceError(mDevice) == RTC_ERROR_NONE &&
-           "Embree device error");
+    // The scene and its geometries are owned by the caller (csTracing), which
+    // keeps them alive across multiple tracing runs. Committing an unmodified
+    // scene is cheap, so the scene is always committed here.
+    auto rtcScene = mScene;
+    const auto boundaryID = mBoundaryID;
+    const auto geometryID = mGeometryID;
 
     const csPair<T> meanFreePath = mParticle->getMeanFreePath();
 
@@ -180,6 +181,14 @@ public:
             while (!particleStack.empty()) {
               auto volumeParticle = std::move(particleStack.back());
               particleStack.pop_back();
+              if (!applyWeightWindow(volumeParticle, *particle, RngState7,
+                                     particleStack))
+                continue;
+
+              // A coarse cell counts as entered again whenever the particle
+              // moves on to another cell of gridDelta inside of it.
+              auto subCellIdx = myCellSet->getSubCellIndex(
+                  volumeParticle.cellId, volumeParticle.position);
 
               // trace particle
               while (volumeParticle.energy >= 0) {
@@ -197,11 +206,20 @@ public:
                 if (newIdx < 0)
                   break;
 
-                if (newIdx != volumeParticle.cellId) {
+                const auto newSubCellIdx =
+                    myCellSet->getSubCellIndex(newIdx, volumeParticle.position);
+                if (newIdx != volumeParticle.cellId ||
+                    newSubCellIdx != subCellIdx) {
                   volumeParticle.cellId = newIdx;
+                  subCellIdx = newSubCellIdx;
+                  const auto weight = volumeParticle.weight;
                   auto fill = particle->collision(volumeParticle, RngState7,
                                                   particleStack);
-                  path.addGridData(newIdx, fill);
+                  path.addGridData(newIdx, weight * fill);
+                  if (volumeParticle.energy >= 0 &&
+                      !applyWeightWindow(volumeParticle, *particle, RngState7,
+                                         particleStack))
+                    break;
                 }
               }
             }
@@ -242,12 +260,34 @@ public:
 
     if (psLogger::getLogLevel() >= 3)
       std::cout << std::endl;
-
-    rtcReleaseGeometry(rtcGeometry);
-    rtcReleaseGeometry(rtcBoundary);
   }
 
 private:
+  // Particles whose weight times importance is below the lower bound of the
+  // weight window are played Russian roulette, the survivors continue with
+  // a score of 1. Particles above the upper bound are split into copies
+  // with a score between 1 and 2. Both keep the expected contribution and
+  // return false if the particle is terminated.
+  bool applyWeightWindow(csVolumeParticle<T> &volumeParticle,
+                         const csAbstractParticle<T> &particle, rayRNG &RNG,
+                         std::vector<csVolumeParticle<T>> &particleStack) {
+    const T importance = particle.getImportance(volumeParticle);
+    const T score = volumeParticle.weight * importance;
+    if (score < mWeightWindow[0]) {
+      std::uniform_real_distribution<T> uniDist;
+      if (score <= 0. || uniDist(RNG) >= score)
+        return false;
+      volumeParticle.weight /= score;
+    } else if (mWeightWindow[1] > 0. && score > mWeightWindow[1]) {
+      const auto numCopies = std::min(
+          std::max(static_cast<unsigned>(score), 1u), maxSplitting);
+      volumeParticle.weight /= numCopies;
+      for (unsigned i = 1; i < numCopies; ++i)
+        particleStack.push_back(volumeParticle);
+    }
+    return true;
+  }
+
   bool checkBounds(const csTriple<T> &hitPoint) const {
     const auto &min = cellSet->getCellGrid()->minimumExtent;
     const auto &max = cellSet->getCellGrid()->maximumExtent;
@@ -292,8 +332,11 @@ private:
 
 private:
   RTCDevice &mDevice;
+  RTCScene &mScene;
   rayGeometry<T, D> &mGeometry;
+  const unsigned mGeometryID;
   rayBoundary<T, D> &mBoundary;
+  const unsigned mBoundaryID;
   raySource<T, D> &mSource;
   std::unique_ptr<csAbstractParticle<T>> const mParticle = nullptr;
   const long long mNumRays;
@@ -302,4 +345,7 @@ private:
   lsSmartPointer<csDenseCellSet<T, D>> cellSet = nullptr;
   const T mGridDelta = 0.;
   const int excludeMaterial = -1;
+  // bounds of the score for splitting and Russian roulette, 0 disables them
+  const csPair<T> mWeightWindow = {0., 0.};
+  static constexpr unsigned maxSplitting = 16;
 };
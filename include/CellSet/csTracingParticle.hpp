@@ -18,8 +18,13 @@ public:
                                                 bool &reflect, rayRNG &Rng) = 0;
   virtual T getSourceDistributionPower() const = 0;
   virtual csPair<T> getMeanFreePath() const = 0;
+  // Returns the fill deposited in the cell. Particles which are added to the
+  // stack have to take over the weight of the colliding particle.
   virtual T collision(csVolumeParticle<T> &particle, rayRNG &RNG,
                       std::vector<csVolumeParticle<T>> &particleStack) = 0;
+  // Expected contribution of a particle with weight 1 relative to a typical
+  // particle, used for splitting and Russian roulette in the cell set.
+  virtual T getImportance(const csVolumeParticle<T> &particle) const = 0;
 };
 
 template <typename Derived, typename T>
@@ -43,6 +48,11 @@ public:
             std::vector<csVolumeParticle<T>> &particleStack) override {
     return 0.;
   }
+  // All particles are equally important, so the weights are never changed.
+  virtual T
+  getImportance(const csVolumeParticle<T> &particle) const override {
+    return 1.;
+  }
 
 protected:
   // We make clear csParticle class needs to be inherited
@@ -5,6 +5,7 @@
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <omp.h>
 #include <vector>
@@ -13,13 +14,25 @@ template <typename T> using csPair = std::array<T, 2>;
 
 template <typename T> using csTriple = std::array<T, 3>;
 
+// material ids of the cells are the indices of the level sets
+using csMaterialIdType = uint8_t;
+
+// index of a cell in the cell set, 32-bit unless large cell sets are enabled
+#ifdef VIENNAPS_64BIT_CELL_INDEX
+using csIndexType = int64_t;
+#else
+using csIndexType = int32_t;
+#endif
+
 template <typename T> struct csVolumeParticle {
   csTriple<T> position;
   csTriple<T> direction;
   T energy;
   T distance;
-  int cellId;
+  csIndexType cellId;
   int scattered;
+  // statistical weight, which scales all contributions of the particle
+  T weight = 1.;
 };
 
 namespace csUtil {
@@ -107,6 +120,66 @@ csTriple<T> crossProd(const csTriple<T> &pVecA, const csTriple<T> &pVecB) {
   return rr;
 }
 
+// Computes the new index of each element for a stream compaction. Elements
+// for which keep(i) returns false are mapped to -1, all others are numbered
+// consecutively in their original order. Returns the number of kept elements.
+template <class IndexType, class KeepFunction>
+size_t compactionIndices(std::vector<IndexType> &newIndices,
+                         KeepFunction keep) {
+  const size_t numElements = newIndices.size();
+  std::vector<size_t> blockOffsets;
+
+#pragma omp parallel
+  {
+    const int numThreads = omp_get_num_threads();
+    const int threadNum = omp_get_thread_num();
+    const size_t begin = numElements * threadNum / numThreads;
+    const size_t end = numElements * (threadNum + 1) / numThreads;
+
+#pragma omp single
+    blockOffsets.resize(numThreads + 1, 0);
+
+    size_t count = 0;
+    for (size_t i = begin; i < end; i++) {
+      if (keep(i))
+        ++count;
+      else
+        newIndices[i] = -1;
+    }
+    blockOffsets[threadNum + 1] = count;
+
+#pragma omp barrier
+#pragma omp single
+    for (int i = 0; i < numThreads; i++)
+      blockOffsets[i + 1] += blockOffsets[i];
+
+    size_t index = blockOffsets[threadNum];
+    for (size_t i = begin; i < end; i++) {
+      if (newIndices[i] != -1)
+        newIndices[i] = index++;
+    }
+  }
+
+  return blockOffsets.back();
+}
+
+// Removes all elements from data which are mapped to -1 in newIndices and
+// moves the remaining ones to their new index. The buffer is used as scratch
+// space and can be reused for further vectors of the same type.
+template <class T, class IndexType>
+void compact(std::vector<T> &data, std::vector<T> &buffer,
+             const std::vector<IndexType> &newIndices, const size_t newSize) {
+  assert(data.size() == newIndices.size() && "Data incompatible");
+  buffer.resize(newSize);
+  const long long n = newIndices.size();
+#pragma omp parallel for
+  for (long long i = 0; i < n; i++) {
+    if (newIndices[i] >= 0)
+      buffer[newIndices[i]] = data[i];
+  }
+  data.swap(buffer);
+}
+
 #ifdef ARCH_X86
 [[nodiscard]] static inline float DotProductSse(__m128 const &x,
                                                 __m128 const &y) {
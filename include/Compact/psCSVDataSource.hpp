@@ -2,6 +2,7 @@
 #define PS_CSV_DATA_SOURCE_HPP
 
 #include <array>
+#include <filesystem>
 #include <regex>
 #include <sstream>
 #include <string>
@@ -24,8 +25,12 @@ class psCSVDataSource : public psDataSource<NumericType> {
   psCSVReader<NumericType> reader;
   psCSVWriter<NumericType> writer;
 
+  std::string filename;
   std::string header;
 
+  // modification time of the file when it was last read or written
+  std::filesystem::file_time_type lastSyncTime{};
+
   bool parametersInitialized = false;
 
   static void
@@ -108,32 +113,39 @@ class psCSVDataSource : public psDataSource<NumericType> {
 
 public:
   using typename Parent::ItemType;
+  using typename Parent::TableType;
   using typename Parent::VectorType;
 
   psCSVDataSource() {}
 
   psCSVDataSource(std::string passedFilename) {
-    reader.setFilename(passedFilename);
-    writer.setFilename(passedFilename);
+    setFilename(passedFilename);
   }
 
   void setFilename(std::string passedFilename) {
+    filename = passedFilename;
     reader.setFilename(passedFilename);
     writer.setFilename(passedFilename);
+    lastSyncTime = {};
   }
 
   void setHeader(const std::string &passedHeader) { header = passedHeader; }
 
-  VectorType read() override {
+  TableType read() override {
+    lastSyncTime = getModificationTime();
     auto opt = reader.readHeader();
     header = opt.value_or("");
-    auto contentOpt = reader.readContent();
-    if (contentOpt)
-      return contentOpt.value();
+    auto tableOpt = reader.readTable();
+    if (tableOpt)
+      return std::move(tableOpt.value());
     return {};
   }
 
-  bool write(const VectorType &data) override {
+  bool sourceChanged() override {
+    return getModificationTime() != lastSyncTime;
+  }
+
+  bool write(const TableType &data) override {
     std::string extendedHeader = header;
     if (!positionalParameters.empty())
       extendedHeader +=
@@ -150,10 +162,12 @@ public:
 
     writer.setHeader(extendedHeader);
     writer.initialize();
-    for (auto &row : data)
-      if (!writer.writeRow(row))
+    for (typename TableType::SizeType i = 0; i < data.size(); ++i)
+      if (!writer.writeRow(data.getItem(i)))
         return false;
 
+    writer.flush();
+    lastSyncTime = getModificationTime();
     return true;
   }
 
@@ -168,6 +182,13 @@ public:
       processHeader();
     return namedParameters;
   }
+
+private:
+  std::filesystem::file_time_type getModificationTime() const {
+    std::error_code errorCode;
+    const auto time = std::filesystem::last_write_time(filename, errorCode);
+    return errorCode ? std::filesystem::file_time_type{} : time;
+  }
 };
 
 #endif
\ No newline at end of file
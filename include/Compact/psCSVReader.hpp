@@ -1,27 +1,247 @@
 #ifndef PS_CSV_READER_HPP
 #define PS_CSV_READER_HPP
 
+#include <algorithm>
 #include <array>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <optional>
-#include <regex>
-#include <sstream>
 #include <string>
+#include <system_error>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PS_CSV_READER_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// std::from_chars for floating point values is not available in all standard
+// libraries
+#ifdef __cpp_lib_to_chars
+#define PS_CSV_READER_FROM_CHARS
+#endif
+
+#include <psDataTable.hpp>
 #include <psLogger.hpp>
 #include <psSmartPointer.hpp>
 #include <psUtils.hpp>
 
-// Simple class for reading CSV files
+// Simple class for reading CSV files. The content is read in one block (or
+// memory mapped) and split into chunks of lines, which are parsed in parallel.
 template <class NumericType> class psCSVReader {
-  // Regex to find trailing and leading whitespaces
-  const std::regex wsRegex = std::regex("^ +| +$|( ) +");
+  // files smaller than this are parsed by a single thread
+  static constexpr size_t minChunkSize = 1 << 20;
 
   std::string filename;
   char delimiter = ',';
-  int numCols = 0;
+  bool parallel = true;
+
+  // Result of parsing a chunk of lines
+  struct Chunk {
+    std::vector<NumericType> values;
+    size_t numRows = 0;
+    size_t numColumns = 0;
+    // start of the first data line, which determines the number of columns
+    const char *firstRow = nullptr;
+    // start of the first line which could not be parsed
+    const char *errorLine = nullptr;
+    bool columnError = false;
+  };
+
+  static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+  // Remove trailing and leading spaces and collapse consecutive spaces
+  static std::string trimSpaces(const std::string &line) {
+    std::string result;
+    result.reserve(line.size());
+    for (const char c : line) {
+      if (c == ' ' && (result.empty() || result.back() == ' '))
+        continue;
+      result.push_back(c);
+    }
+    if (!result.empty() && result.back() == ' ')
+      result.pop_back();
+    return result;
+  }
+
+  static bool parseValue(const char *first, const char *last,
+                         NumericType &value) {
+    // like std::stod, a leading plus sign is accepted
+    if (last - first > 1 && *first == '+' && first[1] != '-')
+      ++first;
+    if (first == last)
+      return false;
+#ifdef PS_CSV_READER_FROM_CHARS
+    const auto [end, errorCode] = std::from_chars(first, last, value);
+    return errorCode == std::errc() && end == last;
+#else
+    const std::string field(first, last);
+    char *end = nullptr;
+    if constexpr (std::is_same_v<NumericType, float>)
+      value = std::strtof(field.c_str(), &end);
+    else if constexpr (std::is_same_v<NumericType, double>)
+      value = std::strtod(field.c_str(), &end);
+    else if constexpr (std::is_floating_point_v<NumericType>)
+      value = static_cast<NumericType>(std::strtold(field.c_str(), &end));
+    else
+      value = static_cast<NumericType>(std::strtoll(field.c_str(), &end, 10));
+    return end == field.c_str() + field.size();
+#endif
+  }
+
+  // Parse the lines in [begin, end). Empty lines and comments are skipped.
+  void parseChunk(const char *begin, const char *end, Chunk &chunk) const {
+    const char *lineBegin = begin;
+    while (lineBegin < end) {
+      const char *lineEnd = static_cast<const char *>(
+          std::memchr(lineBegin, '\n', end - lineBegin));
+      if (lineEnd == nullptr)
+        lineEnd = end;
+
+      const char *first = lineBegin;
+      const char *last = lineEnd;
+      while (first < last && isSpace(*first))
+        ++first;
+      while (last > first && isSpace(last[-1]))
+        --last;
+      // like std::getline, a delimiter at the end of the line does not start
+      // another field
+      if (last > first && last[-1] == delimiter)
+        --last;
+
+      if (first < last && *first != '#') {
+        size_t numFields = 0;
+        const char *field = first;
+        while (true) {
+          const char *fieldEnd = static_cast<const char *>(
+              std::memchr(field, delimiter, last - field));
+          if (fieldEnd == nullptr)
+            fieldEnd = last;
+
+          const char *valueBegin = field;
+          const char *valueEnd = fieldEnd;
+          while (valueBegin < valueEnd && isSpace(*valueBegin))
+            ++valueBegin;
+          while (valueEnd > valueBegin && isSpace(valueEnd[-1]))
+            --valueEnd;
+
+          NumericType value;
+          if (!parseValue(valueBegin, valueEnd, value)) {
+            chunk.errorLine = lineBegin;
+            return;
+          }
+          chunk.values.push_back(value);
+          ++numFields;
+
+          if (fieldEnd == last)
+            break;
+          field = fieldEnd + 1;
+          // runs of spaces count as a single space, so consecutive space
+          // delimiters do not enclose empty fields
+          if (delimiter == ' ')
+            while (field < last && *field == ' ')
+              ++field;
+        }
+
+        // The first row of actual data determines the data dimension
+        if (chunk.numRows == 0) {
+          chunk.numColumns = numFields;
+          chunk.firstRow = lineBegin;
+        } else if (numFields != chunk.numColumns) {
+          chunk.errorLine = lineBegin;
+          chunk.columnError = true;
+          return;
+        }
+        ++chunk.numRows;
+      }
+      lineBegin = lineEnd + 1;
+    }
+  }
+
+  // Parse the whole content of the file into a table
+  std::optional<psDataTable<NumericType>> parseContent(const char *begin,
+                                                       const size_t size) {
+    long long numChunks = 1;
+#ifdef _OPENMP
+    if (parallel)
+      numChunks = std::clamp<long long>(size / minChunkSize, 1,
+                                        omp_get_max_threads());
+#endif
+
+    // the chunks start at the beginning of a line
+    std::vector<const char *> bounds(numChunks + 1, begin + size);
+    bounds[0] = begin;
+    for (long long i = 1; i < numChunks; ++i) {
+      const char *start = std::max(begin + i * (size / numChunks),
+                                   bounds[i - 1]);
+      const char *newline = static_cast<const char *>(
+          std::memchr(start, '\n', begin + size - start));
+      bounds[i] = newline ? newline + 1 : begin + size;
+    }
+
+    std::vector<Chunk> chunks(numChunks);
+#pragma omp parallel for schedule(static, 1) if (numChunks > 1)
+    for (long long i = 0; i < numChunks; ++i)
+      parseChunk(bounds[i], bounds[i + 1], chunks[i]);
+
+    // the errors are reported like for a sequential pass over the lines
+    size_t numColumns = 0;
+    for (const auto &chunk : chunks) {
+      if (numColumns == 0)
+        numColumns = chunk.numColumns;
+      if (chunk.numRows > 0 && chunk.numColumns != numColumns) {
+        reportColumnError(begin, chunk.firstRow);
+        return {};
+      }
+      if (chunk.errorLine != nullptr) {
+        if (chunk.columnError)
+          reportColumnError(begin, chunk.errorLine);
+        else
+          reportError("Error while reading line", begin, chunk.errorLine);
+        return {};
+      }
+    }
+
+    if (numChunks == 1)
+      return psDataTable<NumericType>(std::move(chunks[0].values), numColumns);
+
+    std::vector<size_t> offsets(numChunks + 1, 0);
+    for (long long i = 0; i < numChunks; ++i)
+      offsets[i + 1] = offsets[i] + chunks[i].values.size();
+    std::vector<NumericType> values(offsets.back());
+#pragma omp parallel for schedule(static, 1)
+    for (long long i = 0; i < numChunks; ++i) {
+      std::copy(chunks[i].values.begin(), chunks[i].values.end(),
+                values.begin() + offsets[i]);
+      std::vector<NumericType>().swap(chunks[i].values);
+    }
+    return psDataTable<NumericType>(std::move(values), numColumns);
+  }
+
+  void reportColumnError(const char *begin, const char *line) const {
+    reportError("Invalid number of columns in line", begin, line);
+  }
+
+  // The lines are counted from 0
+  void reportError(const std::string &message, const char *begin,
+                   const char *line) const {
+    const auto lineNumber = std::count(begin, line, '\n');
+    psLogger::getInstance()
+        .addWarning(message + " " + std::to_string(lineNumber) + " in '" +
+                    filename + "'")
+        .print();
+  }
 
 public:
   psCSVReader() {}
@@ -32,6 +252,9 @@ public:
 
   void setDelimiter(char passedDelimiter) { delimiter = passedDelimiter; }
 
+  // Parse large files with multiple threads (default)
+  void setParallel(bool passedParallel) { parallel = passedParallel; }
+
   std::optional<std::string> readHeader() {
     std::ifstream file(filename);
     std::string header;
@@ -40,7 +263,7 @@ public:
       // Iterate over each line
       while (std::getline(file, line)) {
         // Remove trailing and leading whitespaces
-        line = std::regex_replace(line, wsRegex, "$1");
+        line = trimSpaces(line);
 
         // Skip empty lines at the top of the file
         if (line.empty())
@@ -65,66 +288,58 @@ public:
     return {header};
   }
 
-  std::optional<std::vector<std::vector<NumericType>>> readContent() {
-    std::ifstream file(filename);
-    if (file.is_open()) {
-      auto data = std::vector<std::vector<NumericType>>();
-
-      std::string line;
-      int lineCount = 0;
-
-      // Iterate over each line
-      while (std::getline(file, line)) {
-        ++lineCount;
-
-        // Remove trailing and leading whitespaces
-        line = std::regex_replace(line, wsRegex, "$1");
-        // Skip this line if it is marked as a comment
-        if (line.rfind('#') == 0)
-          continue;
+  // Read all data rows of the file into a table. Comment lines starting with
+  // '#' and empty lines are skipped.
+  std::optional<psDataTable<NumericType>> readTable() {
+#ifdef PS_CSV_READER_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+      if (fd >= 0)
+        close(fd);
+      return openError();
+    }
+    const size_t size = fileStat.st_size;
+    if (size == 0) {
+      close(fd);
+      return psDataTable<NumericType>();
+    }
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+      return openError();
+    madvise(mapped, size, MADV_WILLNEED);
 
-        std::istringstream iss(line);
-        std::string tmp;
-        std::vector<NumericType> a;
-        int i = 0;
-        while (std::getline(iss, tmp, delimiter)) {
-          auto valueOpt = psUtils::safeConvert<NumericType>(tmp);
-          if (valueOpt)
-            a.push_back(valueOpt.value());
-          else {
-            psLogger::getInstance()
-                .addWarning("Error while reading line " +
-                            std::to_string(lineCount - 1) + " in '" + filename +
-                            "'")
-                .print();
-            return {};
-          }
-          ++i;
-        }
+    auto table = parseContent(static_cast<const char *>(mapped), size);
+    munmap(mapped, size);
+    return table;
+#else
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+      return openError();
+    std::string content(static_cast<size_t>(file.tellg()), '\0');
+    file.seekg(0);
+    file.read(&content[0], content.size());
+    if (!file)
+      return openError();
+    return parseContent(content.data(), content.size());
+#endif
+  }
 
-        // The first row of actual data determins the data dimension
-        if (numCols == 0)
-          numCols = i;
-
-        if (i != numCols) {
-          psLogger::getInstance()
-              .addWarning("Invalid number of columns in line " +
-                          std::to_string(lineCount - 1) + " in '" + filename +
-                          "'")
-              .print();
-          return {};
-        }
-        data.push_back(a);
-      }
-      file.close();
-      return data;
-    } else {
-      psLogger::getInstance()
-          .addWarning("Couldn't open file '" + filename + "'")
-          .print();
+  std::optional<std::vector<std::vector<NumericType>>> readContent() {
+    auto table = readTable();
+    if (!table)
       return {};
-    }
+    return table->toVector();
+  }
+
+private:
+  std::nullopt_t openError() const {
+    psLogger::getInstance()
+        .addWarning("Couldn't open file '" + filename + "'")
+        .print();
+    return std::nullopt;
   }
 };
 
-#endif
\ No newline at end of file
+#endif
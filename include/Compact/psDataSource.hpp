@@ -2,10 +2,12 @@
 #define PS_DATA_SOURCE_HPP
 
 #include <array>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <psDataTable.hpp>
 #include <psLogger.hpp>
 #include <psSmartPointer.hpp>
 
@@ -13,21 +15,28 @@ template <typename NumericType> class psDataSource {
 public:
   using ItemType = std::vector<NumericType>;
   using VectorType = std::vector<ItemType>;
-  using ConstPtr = psSmartPointer<const VectorType>;
+  using TableType = psDataTable<NumericType>;
+  using ConstPtr = psSmartPointer<const TableType>;
 
-  // Returns a smart pointer to the in-memory copy of the data. If the in-memory
-  // copy of the data is empty, the read function is called on the data source.
+  // Returns a smart pointer to the in-memory copy of the data. The data is
+  // not copied, the same table is returned until the data is modified or the
+  // underlying data source changed, in which case it is read again.
   ConstPtr getData() {
     // Refresh the data
-    if (!modified)
-      data = read();
+    if (!modified && (!data || sourceChanged()))
+      data = psSmartPointer<TableType>::New(read());
 
-    return ConstPtr::New(data);
+    return ConstPtr(std::shared_ptr<const TableType>(data));
   };
 
   void setData(const VectorType &passedData) {
     modified = true;
-    data = passedData;
+    data = psSmartPointer<TableType>::New(passedData);
+  }
+
+  void setData(const TableType &passedData) {
+    modified = true;
+    data = psSmartPointer<TableType>::New(passedData);
   }
 
   // Synchronizes the in-memory copy of the data with the underlying data source
@@ -35,12 +44,12 @@ public:
   bool sync() {
     if (modified) {
       // If the data was modified write it to the underlying data source
-      if (!write(data))
+      if (!write(data ? *data : TableType()))
         return false;
       modified = false;
     } else {
       // If it was not modified, read from the underlying source
-      data = read();
+      data = psSmartPointer<TableType>::New(read());
       modified = true;
     }
     return true;
@@ -49,7 +58,13 @@ public:
   // Adds an item to the in-memory copy of the data
   void add(const ItemType &item) {
     modified = true;
-    data.push_back(item);
+    if (!data)
+      data = psSmartPointer<TableType>::New();
+    else if (data.use_count() > 1)
+      // the table is shared with the users of getData, which keep the old
+      // version
+      data = psSmartPointer<TableType>::New(*data);
+    data->addRow(item);
   }
 
   // Optional: the data source can also expose additional parameters that are
@@ -82,19 +97,23 @@ public:
 protected:
   // Each implementing class has to implement the read function, which reads the
   // complete data of the underlying datasource (e.g. CSV file)
-  virtual VectorType read() = 0;
+  virtual TableType read() = 0;
 
   // Each implementing class has to implement the write function, which writes
   // the content of the in-memory data into the underlying datasource (e.g. CSV
   // file)
-  virtual bool write(const VectorType &) = 0;
+  virtual bool write(const TableType &) = 0;
+
+  // Optional: whether the underlying data source changed since it was last
+  // read or written, so that the in-memory copy has to be read again
+  virtual bool sourceChanged() { return false; }
 
   std::unordered_map<std::string, NumericType> namedParameters;
   std::vector<NumericType> positionalParameters;
 
 private:
-  // An in-memory copy of the data
-  VectorType data;
+  // An in-memory copy of the data, which is shared with the users of getData
+  psSmartPointer<TableType> data = nullptr;
 
   // Flag that specifies whether the in-memory copy of the data has been
   // modified (i.e. whether the append function has been called)
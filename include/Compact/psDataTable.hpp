@@ -0,0 +1,124 @@
+#ifndef PS_DATA_TABLE_HPP
+#define PS_DATA_TABLE_HPP
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <psLogger.hpp>
+
+// Table of numeric data with a fixed number of columns. All values are stored
+// in one contiguous array in row-major order.
+template <typename NumericType> class psDataTable {
+public:
+  using SizeType = size_t;
+  using ItemType = std::vector<NumericType>;
+  using VectorType = std::vector<ItemType>;
+
+private:
+  std::vector<NumericType> values;
+  SizeType numColumns = 0;
+
+public:
+  psDataTable() {}
+
+  psDataTable(SizeType numRows, SizeType passedNumColumns,
+              NumericType value = 0.)
+      : values(numRows * passedNumColumns, value),
+        numColumns(passedNumColumns) {}
+
+  // Takes the values of all rows, in row-major order
+  psDataTable(std::vector<NumericType> &&passedValues,
+              SizeType passedNumColumns)
+      : values(std::move(passedValues)), numColumns(passedNumColumns) {}
+
+  // Copies the rows into the table. All rows have to be of the same size.
+  psDataTable(const VectorType &rows) {
+    if (rows.empty())
+      return;
+    numColumns = rows[0].size();
+    values.reserve(rows.size() * numColumns);
+    for (const auto &row : rows)
+      addRow(row);
+  }
+
+  // Number of rows
+  SizeType size() const {
+    return numColumns == 0 ? 0 : values.size() / numColumns;
+  }
+
+  bool empty() const { return values.empty(); }
+
+  SizeType getNumberOfColumns() const { return numColumns; }
+
+  // The number of columns can only be changed while the table is empty
+  void setNumberOfColumns(SizeType passedNumColumns) {
+    if (!empty()) {
+      psLogger::getInstance()
+          .addWarning("psDataTable: the number of columns of a non-empty "
+                      "table can not be changed.")
+          .print();
+      return;
+    }
+    numColumns = passedNumColumns;
+  }
+
+  void reserve(SizeType numRows) { values.reserve(numRows * numColumns); }
+
+  void clear() { values.clear(); }
+
+  // Appends a row. The first row of an empty table without columns sets the
+  // number of columns.
+  bool addRow(const NumericType *row, SizeType rowSize) {
+    if (numColumns == 0 && empty())
+      numColumns = rowSize;
+    if (rowSize != numColumns || rowSize == 0) {
+      psLogger::getInstance()
+          .addWarning("psDataTable: the row has " + std::to_string(rowSize) +
+                      " instead of " + std::to_string(numColumns) +
+                      " columns.")
+          .print();
+      return false;
+    }
+    values.insert(values.end(), row, row + rowSize);
+    return true;
+  }
+
+  bool addRow(const ItemType &row) { return addRow(row.data(), row.size()); }
+
+  NumericType &operator()(SizeType row, SizeType column) {
+    return values[row * numColumns + column];
+  }
+
+  const NumericType &operator()(SizeType row, SizeType column) const {
+    return values[row * numColumns + column];
+  }
+
+  // Pointer to the first value of a row, the other values of the row follow
+  // contiguously
+  NumericType *getRow(SizeType row) { return &values[row * numColumns]; }
+
+  const NumericType *getRow(SizeType row) const {
+    return &values[row * numColumns];
+  }
+
+  // Copy of a row
+  ItemType getItem(SizeType row) const {
+    return ItemType(getRow(row), getRow(row) + numColumns);
+  }
+
+  NumericType *data() { return values.data(); }
+
+  const NumericType *data() const { return values.data(); }
+
+  // Copy of all rows, e.g. for functions which expect a vector of rows
+  VectorType toVector() const {
+    VectorType rows;
+    rows.reserve(size());
+    for (SizeType i = 0; i < size(); ++i)
+      rows.push_back(getItem(i));
+    return rows;
+  }
+};
+
+#endif
@@ -1,456 +1,1120 @@
-#ifndef PS_KDTREE_HPP
-#define PS_KDTREE_HPP
-
-// Inspired by the implementation of a parallelized kD-Tree by Francesco
-// Andreuzzi (https://github.com/fAndreuzzi/parallel-kd-tree)
-//
-// --------------------- BEGIN ORIGINAL COPYRIGHT NOTICE ---------------------//
-// MIT License
-//
-// Copyright (c) 2021 Francesco Andreuzzi
-//
-// Permission is hereby granted, free of charge, to any person obtaining a copy
-// of this software and associated documentation files (the "Software"), to deal
-// in the Software without restriction, including without limitation the rights
-// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
-// copies of the Software, and to permit persons to whom the Software is
-// furnished to do so, subject to the following conditions:
-//
-// The above copyright notice and this permission notice shall be included in
-// all copies or substantial portions of the Software.
-//
-// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
-// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
-// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
-// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-// SOFTWARE.
-// ---------------------- END ORIGINAL COPYRIGHT NOTICE ----------------------//
-
-#include <algorithm>
-#include <cassert>
-#include <iostream>
-#include <iterator>
-#include <memory>
-#include <optional>
-#include <vector>
-
-#ifdef _OPENMP
-#include <omp.h>
-#endif
-
-#include <psLogger.hpp>
-#include <psQueues.hpp>
-
-template <class NumericType, class ValueType = std::vector<NumericType>>
-class psKDTree {
-  typedef typename std::vector<NumericType>::size_type SizeType;
-
-  struct Node;
-
-  SizeType D = 0;
-  std::vector<NumericType> scalingFactors;
-  std::vector<Node> nodes;
-
-  Node *rootNode = nullptr;
-
-public:
-  psKDTree() {}
-
-  psKDTree(const std::vector<ValueType> &passedPoints) {
-    if (!passedPoints.empty()) {
-      // The first row determins the data dimension
-      D = passedPoints[0].size();
-
-      // Initialize the scaling factors to one
-      scalingFactors = std::vector<NumericType>(D, 1.);
-
-      // Create a vector of nodes
-      nodes.reserve(passedPoints.size());
-      {
-        for (SizeType i = 0; i < passedPoints.size(); ++i) {
-          nodes.emplace_back(passedPoints[i], i);
-        }
-      }
-    } else {
-      psLogger::getInstance()
-          .addWarning("psKDTree: the provided points vector is empty.")
-          .print();
-      return;
-    }
-  }
-
-  void setPoints(const std::vector<ValueType> &passedPoints,
-                 const std::vector<NumericType> &passedScalingFactors = {}) {
-    if (passedPoints.empty()) {
-      psLogger::getInstance()
-          .addWarning("psKDTree: the provided points vector is empty.")
-          .print();
-      return;
-    }
-
-    // The first row determins the data dimension
-    D = passedPoints[0].size();
-
-    scalingFactors.clear();
-    if (passedScalingFactors.empty()) {
-      // Initialize the scaling factors to one
-      scalingFactors = std::vector<NumericType>(D, 1.);
-    } else {
-      assert(
-          passedScalingFactors.size() == D &&
-          "The provided scaling factors have a different dimensionality than "
-          "the data.");
-
-      std::copy(passedScalingFactors.begin(), passedScalingFactors.end(),
-                std::back_inserter(scalingFactors));
-    }
-
-    nodes.clear();
-    nodes.reserve(passedPoints.size());
-    for (SizeType i = 0; i < passedPoints.size(); ++i) {
-      nodes.emplace_back(passedPoints[i], i);
-    }
-  }
-
-  [[nodiscard]] std::optional<std::pair<SizeType, NumericType>>
-  findNearest(const ValueType &x) const {
-    if (!rootNode)
-      return {};
-
-    auto best =
-        std::pair{std::numeric_limits<NumericType>::infinity(), rootNode};
-    traverseDown(rootNode, best, x);
-    return std::pair{best.second->index, Distance(x, best.second->value)};
-  }
-
-  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
-  findKNearest(const ValueType &x, const int k) const {
-    if (!rootNode)
-      return {};
-
-    auto queue = psBoundedPQueue<NumericType, Node *>(k);
-    traverseDown(rootNode, queue, x);
-
-    auto result = std::vector<std::pair<SizeType, NumericType>>();
-    result.reserve(k);
-
-    while (!queue.empty()) {
-      auto best = queue.dequeueBest();
-      result.emplace_back(best->index, Distance(x, best->value));
-    }
-    return result;
-  }
-
-  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
-  findNearestWithinRadius(const ValueType &x, const NumericType radius) const {
-    if (!rootNode)
-      return {};
-
-    auto queue = psClampedPQueue<NumericType, Node *>(radius);
-    traverseDown(rootNode, queue, x);
-
-    auto result = std::vector<std::pair<SizeType, NumericType>>();
-    result.reserve(queue.size());
-
-    while (!queue.empty()) {
-      auto best = queue.dequeueBest();
-      result.emplace_back(best->index, Distance(x, best->value));
-    }
-    return result;
-  }
-
-  void build() {
-    if (nodes.size() == 0) {
-      psLogger::getInstance().addWarning("KDTree: No points provided!").print();
-      return;
-    }
-
-    // Local variable definitions of class member variables. These are needed
-    // for the omp sharing construct to work under MSVC
-    Node *myRootNode = nullptr;
-    std::vector<Node> &myNodes = nodes;
-
-#pragma omp parallel default(none) shared(myNodes, myRootNode)
-    {
-      int numThreads = 1;
-#pragma omp single
-      {
-#ifdef _OPENMP
-        numThreads = omp_get_num_threads();
-#endif
-        int maxParallelDepth = intLog2(numThreads);
-        int surplusWorkers = numThreads - (1 << maxParallelDepth);
-
-        auto size = static_cast<int>(myNodes.size());
-        auto medianIndex = (size + 1) / 2 - 1;
-
-        std::nth_element(
-            myNodes.begin(), std::next(myNodes.begin(), medianIndex),
-            myNodes.end(),
-            [](Node &a, Node &b) { return a.value[0] < b.value[0]; });
-
-        myRootNode = &myNodes[static_cast<SizeType>(medianIndex)];
-        myRootNode->axis = 0;
-
-#ifdef _OPENMP
-        bool dontSpawnMoreThreads = 0 > maxParallelDepth + 1 ||
-                                    (0 == maxParallelDepth + 1 &&
-                                     omp_get_thread_num() >= surplusWorkers);
-#endif
-#pragma omp task final(dontSpawnMoreThreads)
-        {
-          // Left Subtree
-          build(myRootNode,      // Use rootNode as parent
-                myNodes.begin(), // Data start
-                std::next(myNodes.begin(), medianIndex), // Data end
-                1,                                       // Depth
-                true,                                    // Left
-                surplusWorkers, maxParallelDepth);
-        }
-
-        // Right Subtree
-        build(myRootNode, // Use rootNode as parent
-              std::next(myNodes.begin(), medianIndex + 1), // Data start
-              myNodes.end(),                               // Data end
-              1,                                           // Depth
-              false,                                       // Right
-              surplusWorkers, maxParallelDepth);
-#pragma omp taskwait
-      }
-    }
-
-    rootNode = myRootNode;
-  }
-
-private:
-  void build(Node *parent, typename std::vector<Node>::iterator start,
-             typename std::vector<Node>::iterator end, SizeType depth,
-             bool isLeft, int surplusWorkers, int maxParallelDepth) const {
-    auto size = std::distance(start, end);
-    auto axis = depth % D;
-
-    if (size > 1) {
-      auto medianIndex = (size + 1) / 2 - 1;
-      std::nth_element(
-          start, std::next(start, medianIndex), end,
-          [axis](Node &a, Node &b) { return a.value[axis] < b.value[axis]; });
-
-      Node *current = toRawPointer(std::next(start, medianIndex));
-      current->axis = axis;
-
-      if (isLeft)
-        parent->left = current;
-      else
-        parent->right = current;
-
-#ifdef _OPENMP
-      bool dontSpawnMoreThreads =
-          static_cast<int>(depth) > maxParallelDepth + 1 ||
-          (static_cast<int>(depth) == maxParallelDepth + 1 &&
-           omp_get_thread_num() >= surplusWorkers);
-#endif
-#pragma omp task final(dontSpawnMoreThreads)
-      {
-        // Left Subtree
-        build(current,                       // Use current node as parent
-              start,                         // Data start
-              std::next(start, medianIndex), // Data end
-              depth + 1,                     // Depth
-              true,                          // Left
-              surplusWorkers, maxParallelDepth);
-      }
-
-      //  Right Subtree
-      build(current,                           // Use current node as parent
-            std::next(start, medianIndex + 1), // Data start
-            end,                               // Data end
-            depth + 1,                         // Depth
-            false,                             // Right
-            surplusWorkers, maxParallelDepth);
-#pragma omp taskwait
-    } else if (size == 1) {
-      Node *current = toRawPointer(start);
-      current->axis = axis;
-      // Leaf Node
-      if (isLeft)
-        parent->left = current;
-      else
-        parent->right = current;
-    }
-  }
-
-  /****************************************************************************
-   * Recursive Tree Traversal                                                 *
-   ****************************************************************************/
-  void traverseDown(Node *currentNode, std::pair<NumericType, Node *> &best,
-                    const ValueType &x) const {
-    if (currentNode == nullptr)
-      return;
-
-    auto axis = currentNode->axis;
-
-    // For distance comparison operations we only use the "reduced" aka less
-    // compute intensive, but order preserving version of the distance
-    // function.
-    auto distance = SquaredDistance(x, currentNode->value);
-    if (distance < best.first)
-      best = std::pair{distance, currentNode};
-
-    bool isLeft;
-    if (x[axis] < currentNode->value[axis]) {
-      traverseDown(currentNode->left, best, x);
-      isLeft = true;
-    } else {
-      traverseDown(currentNode->right, best, x);
-      isLeft = false;
-    }
-
-    // If the hypersphere with origin at x and a radius of our current best
-    // distance intersects the hyperplane defined by the partitioning of the
-    // current node, we also have to search the other subtree, since there could
-    // be points closer to x than our current best.
-    auto distanceToHyperplane =
-        scalingFactors[axis] * std::abs(x[axis] - currentNode->value[axis]);
-    distanceToHyperplane *= distanceToHyperplane;
-    if (distanceToHyperplane < best.first) {
-      if (isLeft)
-        traverseDown(currentNode->right, best, x);
-      else
-        traverseDown(currentNode->left, best, x);
-    }
-    return;
-  }
-
-  template <typename Q,
-            typename = std::enable_if_t<
-                std::is_same_v<Q, psBoundedPQueue<NumericType, Node *>> ||
-                std::is_same_v<Q, psClampedPQueue<NumericType, Node *>>>>
-  void traverseDown(Node *currentNode, Q &queue,
-                    const std::vector<NumericType> &x) const {
-    if (currentNode == nullptr)
-      return;
-
-    int axis = currentNode->axis;
-
-    // For distance comparison operations we only use the squared distance which
-    // is less compute intensive, but order preserving version of the distance
-    // function.
-    queue.enqueue(
-        std::pair{SquaredDistance(x, currentNode->value), currentNode});
-
-    bool isLeft;
-    if (x[axis] < currentNode->value[axis]) {
-      traverseDown(currentNode->left, queue, x);
-      isLeft = true;
-    } else {
-      traverseDown(currentNode->right, queue, x);
-      isLeft = false;
-    }
-
-    // If the hypersphere with origin at x and a radius of our current best
-    // distance intersects the hyperplane defined by the partitioning of the
-    // current node, we also have to search the other subtree, since there could
-    // be points closer to x than our current best.
-    auto distanceToHyperplane =
-        scalingFactors[axis] * std::abs(x[axis] - currentNode->value[axis]);
-    distanceToHyperplane *= distanceToHyperplane;
-
-    bool intersects = false;
-    if constexpr (std::is_same_v<Q, psBoundedPQueue<NumericType, Node *>>) {
-      intersects = queue.size() < queue.maxSize() ||
-                   distanceToHyperplane < queue.worst();
-    } else if constexpr (std::is_same_v<Q,
-                                        psClampedPQueue<NumericType, Node *>>) {
-      intersects = distanceToHyperplane < queue.worst();
-    }
-
-    if (intersects) {
-      if (isLeft)
-        traverseDown(currentNode->right, queue, x);
-      else
-        traverseDown(currentNode->left, queue, x);
-    }
-    return;
-  }
-
-  /****************************************************************************
-   * Utility Functions                                                        *
-   ****************************************************************************/
-
-  // Converts Iterator to a raw pointer
-  template <class Iterator>
-  [[nodiscard]] static typename Iterator::pointer
-  toRawPointer(const Iterator it) {
-    return &(*it);
-  }
-
-  // Quickly calculate the log2 of signed ints
-  template <typename SignedInt,
-            typename = std::enable_if_t<std::is_integral_v<SignedInt> &&
-                                        std::is_signed_v<SignedInt>>>
-  [[nodiscard]] static constexpr SignedInt intLog2(SignedInt x) {
-    SignedInt val = 0;
-    while (x >>= 1)
-      ++val;
-    return val;
-  }
-
-  [[nodiscard]] NumericType SquaredDistance(const ValueType &pVecA,
-                                            const ValueType &pVecB) const {
-    NumericType norm = 0;
-    for (SizeType i = 0; i < D; ++i)
-      norm += scalingFactors[i] * scalingFactors[i] * (pVecA[i] - pVecB[i]) *
-              (pVecA[i] - pVecB[i]);
-    return norm;
-  }
-
-  [[nodiscard]] NumericType Distance(const ValueType &pVecA,
-                                     const ValueType &pVecB) const {
-    return std::sqrt(SquaredDistance(pVecA, pVecB));
-  }
-
-  /****************************************************************************
-   * The Node struct implementation                                           *
-   ****************************************************************************/
-  struct Node {
-    ValueType value{};
-    SizeType index{};
-    SizeType axis{};
-
-    Node *left = nullptr;
-    Node *right = nullptr;
-
-    Node(const ValueType &passedValue, SizeType passedIndex) noexcept
-        : value(passedValue), index(passedIndex) {}
-
-    Node(Node &&other) noexcept {
-      value.swap(other.value);
-      index = other.index;
-      axis = other.axis;
-
-      left = other.left;
-      right = other.right;
-
-      other.left = nullptr;
-      other.right = nullptr;
-    }
-
-    Node &operator=(Node &&other) noexcept {
-      value.swap(other.value);
-      index = other.index;
-      axis = other.axis;
-
-      left = other.left;
-      right = other.right;
-
-      other.left = nullptr;
-      other.right = nullptr;
-
-      return *this;
-    }
-  };
-};
-
-#endif
\ No newline at end of file
+#ifndef PS_KDTREE_HPP
+#define PS_KDTREE_HPP
+
+// Inspired by the implementation of a parallelized kD-Tree by Francesco
+// Andreuzzi (https://github.com/fAndreuzzi/parallel-kd-tree)
+//
+// --------------------- BEGIN ORIGINAL COPYRIGHT NOTICE ---------------------//
+// MIT License
+//
+// Copyright (c) 2021 Francesco Andreuzzi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+// ---------------------- END ORIGINAL COPYRIGHT NOTICE ----------------------//
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PS_KDTREE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <psLogger.hpp>
+#include <psQueues.hpp>
+
+// The dimension of the points is known at compile time if they are stored in
+// std::arrays, 0 stands for a dimension which is only known at runtime.
+template <class ValueType> struct psKDTreeDimension {
+  static constexpr std::size_t value = 0;
+};
+
+template <class T, std::size_t N> struct psKDTreeDimension<std::array<T, N>> {
+  static constexpr std::size_t value = N;
+};
+
+/// kD-Tree without pointers. The tree is balanced and implicitly indexed: the
+/// children of node i are the nodes 2i+1 and 2i+2 and each node splits the
+/// points of its range in half. The leaves are buckets of up to leafSize
+/// points, whose (scaled) coordinates are stored contiguously per axis, so
+/// the distances to all points of a leaf are computed in one vectorized loop.
+///
+/// The tree can be updated without rebuilding it: moved points only refit
+/// the bounding boxes of the nodes, inserted points are kept in a separate
+/// buffer and removed points are only marked. The tree is rebuilt once the
+/// pending changes or the growth of the leaves exceed a threshold.
+///
+/// A built tree can be saved to a binary file and loaded again instead of
+/// being rebuilt. The file stores the tree in the native byte order, with a
+/// header followed by the arrays of the tree, each preceded by its length:
+///
+///   char[8]  magic "PSKDTREE"
+///   uint32   format version
+///   uint32   byte order mark 0x01020304
+///   uint32   size of a coordinate and of an index in bytes (two values)
+///   uint64   dimension, number of points, number of tree levels
+///   uint64   hash of the data the tree was built from
+///   coord    slack of the boxes and summed leaf extent after the build
+///   uint32   whether the split values are valid
+///   arrays   scaling factors, coordinates, indices, split axes, split
+///            values, leaf offsets and bounding boxes
+template <class NumericType, class ValueType = std::vector<NumericType>>
+class psKDTree {
+  typedef typename std::vector<NumericType>::size_type SizeType;
+
+  static constexpr SizeType staticDimension =
+      psKDTreeDimension<ValueType>::value;
+  static constexpr SizeType leafSize = 16;
+  // enough for any tree which fits into memory
+  static constexpr SizeType maxDepth = 64;
+
+  using PointType = std::conditional_t<(staticDimension > 0),
+                                       std::array<NumericType, staticDimension>,
+                                       std::vector<NumericType>>;
+
+  SizeType D = staticDimension;
+  SizeType numPoints = 0;
+  SizeType numLevels = 0;
+  bool isBuilt = false;
+  std::vector<NumericType> scalingFactors;
+
+  // scaled coordinates, one array of numPoints values per axis, in the order
+  // of the leaves after the tree is built
+  std::vector<NumericType> coordinates;
+  // index of the point in the passed points vector
+  std::vector<SizeType> indices;
+  // split axis and value of the inner nodes
+  std::vector<unsigned char> splitAxes;
+  std::vector<NumericType> splitValues;
+  // first position of each leaf and the end of the last leaf
+  std::vector<SizeType> leafOffsets;
+  // bounding boxes of all nodes, the minima of all axes followed by the maxima
+  std::vector<NumericType> boxes;
+  // upper bound of the movement of the points since the boxes were fitted
+  NumericType slack = 0.;
+  // sum of the extents of the leaves after the last build
+  NumericType builtLeafExtent = 0.;
+  // the split values separate the points of the children until points move,
+  // afterwards the bounding boxes are used for pruning
+  bool splitsValid = false;
+
+  // lazy updates: removed points are only marked, inserted points are stored
+  // unsorted behind the tree
+  std::vector<char> removed;
+  SizeType numRemoved = 0;
+  std::vector<NumericType> insertedCoordinates; // D values per point
+  std::vector<SizeType> insertedIndices;
+  // position of each index in the tree, numPoints + k for the k-th inserted
+  // point, or invalidPosition for removed points
+  std::vector<SizeType> positions;
+  static constexpr SizeType invalidPosition =
+      std::numeric_limits<SizeType>::max();
+
+  NumericType maxPendingFraction = 0.25;
+  NumericType maxLeafGrowth = 2.;
+
+  // approximate search: (1 + epsilon)^2, and the maximum number of leaves
+  // visited per query, 0 for no limit
+  NumericType approximationFactor = 1.;
+  SizeType maxLeafVisits = 0;
+
+public:
+  // Work done by a single query.
+  struct QueryStatistics {
+    SizeType visitedNodes = 0; // inner nodes and leaves
+    SizeType visitedLeaves = 0;
+    SizeType visitedPoints = 0; // including the inserted points
+  };
+
+  psKDTree() {}
+
+  psKDTree(const std::vector<ValueType> &passedPoints) {
+    setPoints(passedPoints);
+  }
+
+  void setPoints(const std::vector<ValueType> &passedPoints,
+                 const std::vector<NumericType> &passedScalingFactors = {}) {
+    isBuilt = false;
+    if (passedPoints.empty()) {
+      psLogger::getInstance()
+          .addWarning("psKDTree: the provided points vector is empty.")
+          .print();
+      return;
+    }
+
+    // The first row determins the data dimension
+    if constexpr (staticDimension == 0)
+      D = passedPoints[0].size();
+
+    scalingFactors.clear();
+    if (passedScalingFactors.empty()) {
+      // Initialize the scaling factors to one
+      scalingFactors = std::vector<NumericType>(D, 1.);
+    } else {
+      assert(
+          passedScalingFactors.size() == D &&
+          "The provided scaling factors have a different dimensionality than "
+          "the data.");
+
+      std::copy(passedScalingFactors.begin(), passedScalingFactors.end(),
+                std::back_inserter(scalingFactors));
+    }
+
+    numPoints = passedPoints.size();
+    coordinates.resize(numPoints * D);
+    const long long n = numPoints;
+#pragma omp parallel for
+    for (long long i = 0; i < n; ++i) {
+      for (SizeType axis = 0; axis < getDimension(); ++axis)
+        coordinates[axis * numPoints + i] =
+            scalingFactors[axis] * passedPoints[i][axis];
+    }
+  }
+
+  [[nodiscard]] SizeType getDimension() const {
+    if constexpr (staticDimension > 0)
+      return staticDimension;
+    else
+      return D;
+  }
+
+  // Number of points which were not removed.
+  [[nodiscard]] SizeType size() const {
+    return numPoints - numRemoved + insertedIndices.size();
+  }
+
+  // The tree is rebuilt if the number of inserted and removed points exceeds
+  // maxPendingFraction times the number of points in the tree, or if
+  // refitting grew the summed extent of the leaves by more than maxLeafGrowth.
+  void setRebuildThresholds(const NumericType passedMaxPendingFraction,
+                            const NumericType passedMaxLeafGrowth) {
+    maxPendingFraction = passedMaxPendingFraction;
+    maxLeafGrowth = passedMaxLeafGrowth;
+  }
+
+  // Enables the (1 + epsilon) approximate search for the nearest and k
+  // nearest neighbors: subtrees are skipped if they cannot contain a point
+  // which is closer than the current candidates divided by 1 + epsilon. The
+  // distance of the i-th returned neighbor is then at most 1 + epsilon times
+  // the distance of the exact i-th neighbor. If maxLeafVisits is larger than
+  // 0, each query stops after visiting this many leaves and the bound no
+  // longer holds. Radius queries always stay exact.
+  void setApproximation(const NumericType epsilon,
+                        const SizeType passedMaxLeafVisits = 0) {
+    const NumericType factor = 1 + std::max(epsilon, NumericType(0));
+    approximationFactor = factor * factor;
+    maxLeafVisits = passedMaxLeafVisits;
+  }
+
+  // Move the points to the given coordinates. If the number of points is
+  // unchanged and there are no pending insertions or removals, the tree is
+  // kept and only refitted. Refitting is skipped as long as the points moved
+  // less than epsilon (in scaled coordinates) along each axis since the last
+  // refit. The queries stay exact in this case, since the bounding boxes are
+  // enlarged by the movement.
+  void updatePoints(const std::vector<ValueType> &passedPoints,
+                    const NumericType epsilon = 0.) {
+    if (!isBuilt || passedPoints.size() != numPoints ||
+        positions.size() != numPoints || numRemoved > 0 ||
+        !insertedIndices.empty()) {
+      const auto factors = scalingFactors;
+      setPoints(passedPoints, factors);
+      build();
+      return;
+    }
+
+    NumericType displacement = 0.;
+    const long long n = numPoints;
+#pragma omp parallel for reduction(max : displacement)
+    for (long long i = 0; i < n; ++i) {
+      const auto &point = passedPoints[indices[i]];
+      for (SizeType axis = 0; axis < getDimension(); ++axis) {
+        const NumericType value = scalingFactors[axis] * point[axis];
+        auto &coordinate = coordinates[axis * numPoints + i];
+        displacement = std::max(displacement, std::abs(value - coordinate));
+        coordinate = value;
+      }
+    }
+
+    if (displacement > 0.)
+      splitsValid = false;
+    slack += displacement;
+    if (slack <= epsilon)
+      return;
+
+    refit();
+    if (getLeafExtent() > maxLeafGrowth * builtLeafExtent)
+      rebuild();
+  }
+
+  // Add a point to the built tree and return its index, which follows the
+  // indices of all points added so far.
+  SizeType insertPoint(const ValueType &point) {
+    const SizeType index = positions.size();
+    positions.push_back(numPoints + insertedIndices.size());
+    insertedIndices.push_back(index);
+    for (SizeType axis = 0; axis < getDimension(); ++axis)
+      insertedCoordinates.push_back(scalingFactors[axis] * point[axis]);
+
+    rebuildIfNeeded();
+    return index;
+  }
+
+  void removePoint(const SizeType index) {
+    if (index >= positions.size() || positions[index] == invalidPosition)
+      return;
+
+    const auto position = positions[index];
+    positions[index] = invalidPosition;
+    if (position < numPoints) {
+      removed[position] = 1;
+      ++numRemoved;
+    } else {
+      // move the last inserted point into the gap
+      const SizeType k = position - numPoints;
+      const SizeType last = insertedIndices.size() - 1;
+      if (k != last) {
+        insertedIndices[k] = insertedIndices[last];
+        positions[insertedIndices[k]] = position;
+        std::copy_n(&insertedCoordinates[last * getDimension()],
+                    getDimension(), &insertedCoordinates[k * getDimension()]);
+      }
+      insertedIndices.pop_back();
+      insertedCoordinates.resize(last * getDimension());
+    }
+
+    rebuildIfNeeded();
+  }
+
+  [[nodiscard]] std::optional<std::pair<SizeType, NumericType>>
+  findNearest(const ValueType &x) const {
+    if (!isBuilt)
+      return {};
+
+    const auto best = searchNearest(scalePoint(x));
+    return std::pair{getPointIndex(best.second), std::sqrt(best.first)};
+  }
+
+  // Same as above, but also reports the work done by the query.
+  [[nodiscard]] std::optional<std::pair<SizeType, NumericType>>
+  findNearest(const ValueType &x, QueryStatistics &statistics) const {
+    statistics = QueryStatistics{};
+    if (!isBuilt)
+      return {};
+
+    const auto best = searchNearest(scalePoint(x), &statistics);
+    return std::pair{getPointIndex(best.second), std::sqrt(best.first)};
+  }
+
+  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
+  findKNearest(const ValueType &x, const int k) const {
+    if (!isBuilt)
+      return {};
+
+    auto queue = psBoundedPQueue<NumericType, SizeType>(k);
+    searchKNearest(scalePoint(x), queue);
+    return toResult(queue);
+  }
+
+  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
+  findKNearest(const ValueType &x, const int k,
+               QueryStatistics &statistics) const {
+    statistics = QueryStatistics{};
+    if (!isBuilt)
+      return {};
+
+    auto queue = psBoundedPQueue<NumericType, SizeType>(k);
+    searchKNearest(scalePoint(x), queue, &statistics);
+    return toResult(queue);
+  }
+
+  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
+  findNearestWithinRadius(const ValueType &x, const NumericType radius) const {
+    if (!isBuilt)
+      return {};
+
+    const auto point = scalePoint(x);
+    const NumericType radiusSquared = radius * radius;
+    auto queue = psClampedPQueue<NumericType, SizeType>(radiusSquared);
+    traverse(
+        point, [radiusSquared]() { return radiusSquared; },
+        [&queue](SizeType position, NumericType distance) {
+          queue.enqueue(std::pair{distance, position});
+        },
+        false);
+
+    return toResult(queue);
+  }
+
+  // Nearest neighbor of each query point. The queries are processed in
+  // parallel and in the order of the leaves they fall into, so that
+  // consecutive queries visit the same parts of the tree. The index of the
+  // nearest point and its distance are written to nearestIndices[i] and
+  // distances[i], which have to hold one value per query.
+  void findNearestBatch(const ValueType *queries, const SizeType numQueries,
+                        SizeType *nearestIndices,
+                        NumericType *distances) const {
+    if (!isBuilt)
+      return;
+
+    const auto order = getQueryOrder(queries, numQueries);
+    const long long count = numQueries;
+#pragma omp parallel for schedule(dynamic, 256)
+    for (long long j = 0; j < count; ++j) {
+      const auto i = order[j];
+      const auto best = searchNearest(scalePoint(queries[i]));
+      nearestIndices[i] = getPointIndex(best.second);
+      distances[i] = std::sqrt(best.first);
+    }
+  }
+
+  void findNearestBatch(const std::vector<ValueType> &queries,
+                        std::vector<SizeType> &nearestIndices,
+                        std::vector<NumericType> &distances) const {
+    nearestIndices.resize(queries.size());
+    distances.resize(queries.size());
+    findNearestBatch(queries.data(), queries.size(), nearestIndices.data(),
+                     distances.data());
+  }
+
+  // The k nearest neighbors of each query point, processed like in
+  // findNearestBatch. The neighbors of query i are written to the positions
+  // [i * k, (i + 1) * k) of nearestIndices and distances, the closest first.
+  // If the tree holds less than k points, the remaining positions are set to
+  // an index past the last point and infinity.
+  void findKNearestBatch(const ValueType *queries, const SizeType numQueries,
+                         const int k, SizeType *nearestIndices,
+                         NumericType *distances) const {
+    if (!isBuilt || k <= 0)
+      return;
+
+    const auto order = getQueryOrder(queries, numQueries);
+    const long long count = numQueries;
+#pragma omp parallel
+    {
+      // one queue per thread, which is reused for all queries
+      auto queue = psBoundedPQueue<NumericType, SizeType>(k);
+#pragma omp for schedule(dynamic, 256)
+      for (long long j = 0; j < count; ++j) {
+        const auto i = order[j];
+        queue.clear();
+        searchKNearest(scalePoint(queries[i]), queue);
+
+        for (SizeType n = i * k; n < (i + 1) * k; ++n) {
+          if (queue.empty()) {
+            nearestIndices[n] = positions.size();
+            distances[n] = std::numeric_limits<NumericType>::infinity();
+          } else {
+            distances[n] = std::sqrt(queue.best());
+            nearestIndices[n] = getPointIndex(queue.dequeueBest());
+          }
+        }
+      }
+    }
+  }
+
+  void findKNearestBatch(const std::vector<ValueType> &queries, const int k,
+                         std::vector<SizeType> &nearestIndices,
+                         std::vector<NumericType> &distances) const {
+    nearestIndices.resize(queries.size() * std::max(k, 0));
+    distances.resize(queries.size() * std::max(k, 0));
+    findKNearestBatch(queries.data(), queries.size(), k,
+                      nearestIndices.data(), distances.data());
+  }
+
+  // Hash of the coordinates of the points, which identifies the data a saved
+  // tree was built from. It is not a cryptographic hash.
+  [[nodiscard]] static uint64_t
+  computeDataHash(const std::vector<ValueType> &passedPoints) {
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a, per value
+    auto add = [&hash](uint64_t value) {
+      hash = (hash ^ value) * 0x100000001b3ull;
+    };
+    add(passedPoints.size());
+    for (const auto &point : passedPoints) {
+      add(point.size());
+      for (const NumericType value : point) {
+        uint64_t bits = 0;
+        std::memcpy(&bits, &value, std::min(sizeof(value), sizeof(bits)));
+        add(bits);
+      }
+    }
+    return hash ^ (hash >> 29);
+  }
+
+  // Write the built tree to a binary file. dataHash is stored with the tree,
+  // so that load can check that the tree belongs to the current data. Trees
+  // with pending insertions or removals are not saved.
+  bool save(const std::string &fileName, const uint64_t dataHash = 0) const {
+    if (!isBuilt || numRemoved > 0 || !insertedIndices.empty()) {
+      psLogger::getInstance()
+          .addWarning("KDTree: Only built trees without pending insertions "
+                      "or removals can be saved.")
+          .print();
+      return false;
+    }
+    std::ofstream file(fileName, std::ios::binary);
+    if (!file.is_open()) {
+      psLogger::getInstance()
+          .addWarning("Could not open file " + fileName)
+          .print();
+      return false;
+    }
+
+    auto write = [&file](const auto &value) {
+      file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    };
+    auto writeArray = [&file, &write](const auto &values) {
+      write(uint64_t(values.size()));
+      file.write(reinterpret_cast<const char *>(values.data()),
+                 values.size() * sizeof(values[0]));
+    };
+    file.write(fileMagic, sizeof(fileMagic));
+    write(fileVersion);
+    write(byteOrderMark);
+    write(uint32_t(sizeof(NumericType)));
+    write(uint32_t(sizeof(SizeType)));
+    write(uint64_t(getDimension()));
+    write(uint64_t(numPoints));
+    write(uint64_t(numLevels));
+    write(dataHash);
+    write(slack);
+    write(builtLeafExtent);
+    write(uint32_t(splitsValid));
+    writeArray(scalingFactors);
+    writeArray(coordinates);
+    writeArray(indices);
+    writeArray(splitAxes);
+    writeArray(splitValues);
+    writeArray(leafOffsets);
+    writeArray(boxes);
+
+    return file.good();
+  }
+
+  // Load a tree written by save. Returns false if the file can not be read,
+  // was written on a platform with a different layout of the values, or
+  // dataHash differs from the stored hash. The tree is unchanged in this
+  // case and has to be built from the points. The file is memory mapped
+  // where possible.
+  bool load(const std::string &fileName, const uint64_t dataHash = 0) {
+#ifdef PS_KDTREE_MMAP
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    const size_t fileSize = fileStat.st_size;
+    void *mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+      return false;
+
+    const char *begin = static_cast<const char *>(mapped);
+    auto readBytes = [begin, fileSize](size_t offset, void *dest,
+                                       size_t size) {
+      if (offset > fileSize || size > fileSize - offset)
+        return false;
+      std::memcpy(dest, begin + offset, size);
+      return true;
+    };
+    const bool success = readContent(readBytes, fileSize, dataHash);
+    munmap(mapped, fileSize);
+#else
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+      return false;
+    const size_t fileSize = static_cast<size_t>(file.tellg());
+    auto readBytes = [&file](size_t offset, void *dest, size_t size) {
+      file.seekg(offset);
+      file.read(static_cast<char *>(dest), size);
+      return bool(file);
+    };
+    const bool success = readContent(readBytes, fileSize, dataHash);
+#endif
+    return success;
+  }
+
+  void build() {
+    isBuilt = false;
+    std::vector<SizeType> pointIndices(numPoints);
+    for (SizeType i = 0; i < numPoints; ++i)
+      pointIndices[i] = i;
+    positions.assign(numPoints, invalidPosition);
+    buildTree(pointIndices);
+  }
+
+private:
+  // Build the tree from the coordinates, which belong to the points with the
+  // given indices.
+  void buildTree(const std::vector<SizeType> &pointIndices) {
+    isBuilt = false;
+    numRemoved = 0;
+    insertedIndices.clear();
+    insertedCoordinates.clear();
+    if (numPoints == 0) {
+      psLogger::getInstance().addWarning("KDTree: No points provided!").print();
+      return;
+    }
+
+    // the tree is refined until all leaves hold at most leafSize points
+    numLevels = 0;
+    while (((numPoints - 1) >> numLevels) + 1 > leafSize)
+      ++numLevels;
+
+    const SizeType numInnerNodes = (SizeType(1) << numLevels) - 1;
+    splitAxes.assign(numInnerNodes, 0);
+    splitValues.assign(numInnerNodes, 0.);
+    leafOffsets.resize(numInnerNodes + 2);
+    leafOffsets.back() = numPoints;
+    indices.resize(numPoints);
+    for (SizeType i = 0; i < numPoints; ++i)
+      indices[i] = i;
+
+#pragma omp parallel
+    {
+#pragma omp single
+      {
+        int numThreads = 1;
+#ifdef _OPENMP
+        numThreads = omp_get_num_threads();
+#endif
+        // subtrees below this depth are built by a single thread
+        const SizeType parallelDepth =
+            static_cast<SizeType>(intLog2(numThreads)) + 2;
+        build(0, 0, numPoints, 0, parallelDepth);
+      }
+    }
+
+    // store the coordinates in the order of the leaves
+    std::vector<NumericType> sortedCoordinates(coordinates.size());
+    const long long n = numPoints;
+#pragma omp parallel for
+    for (long long i = 0; i < n; ++i) {
+      for (SizeType axis = 0; axis < getDimension(); ++axis)
+        sortedCoordinates[axis * numPoints + i] =
+            coordinates[axis * numPoints + indices[i]];
+    }
+    coordinates.swap(sortedCoordinates);
+
+    for (SizeType i = 0; i < numPoints; ++i) {
+      indices[i] = pointIndices[indices[i]];
+      positions[indices[i]] = i;
+    }
+    removed.assign(numPoints, 0);
+
+    refit();
+    builtLeafExtent = getLeafExtent();
+    splitsValid = true;
+    isBuilt = true;
+  }
+
+  // Rebuild the tree from all points which were not removed.
+  void rebuild() {
+    const SizeType numLive = size();
+    std::vector<NumericType> liveCoordinates(numLive * getDimension());
+    std::vector<SizeType> liveIndices;
+    liveIndices.reserve(numLive);
+    for (SizeType i = 0; i < numPoints + insertedIndices.size(); ++i) {
+      if (i < numPoints && removed[i])
+        continue;
+      const SizeType j = liveIndices.size();
+      liveIndices.push_back(getPointIndex(i));
+      for (SizeType axis = 0; axis < getDimension(); ++axis)
+        liveCoordinates[axis * numLive + j] =
+            i < numPoints
+                ? coordinates[axis * numPoints + i]
+                : insertedCoordinates[(i - numPoints) * getDimension() + axis];
+    }
+
+    coordinates.swap(liveCoordinates);
+    numPoints = numLive;
+    buildTree(liveIndices);
+  }
+
+  void rebuildIfNeeded() {
+    if (isBuilt && numRemoved + insertedIndices.size() >
+                       maxPendingFraction * static_cast<NumericType>(numPoints))
+      rebuild();
+  }
+
+  // Fit the bounding boxes of the leaves to their points and the boxes of the
+  // inner nodes to their children.
+  void refit() {
+    const SizeType dim = getDimension();
+    const SizeType numInnerNodes = splitAxes.size();
+    boxes.resize((2 * numInnerNodes + 1) * 2 * dim);
+
+    const long long numLeaves = numInnerNodes + 1;
+#pragma omp parallel for
+    for (long long leaf = 0; leaf < numLeaves; ++leaf) {
+      NumericType *box = &boxes[(numInnerNodes + leaf) * 2 * dim];
+      for (SizeType axis = 0; axis < dim; ++axis) {
+        const NumericType *axisCoordinates = &coordinates[axis * numPoints];
+        NumericType minValue = std::numeric_limits<NumericType>::max();
+        NumericType maxValue = std::numeric_limits<NumericType>::lowest();
+        for (SizeType i = leafOffsets[leaf]; i < leafOffsets[leaf + 1]; ++i) {
+          minValue = std::min(minValue, axisCoordinates[i]);
+          maxValue = std::max(maxValue, axisCoordinates[i]);
+        }
+        box[axis] = minValue;
+        box[dim + axis] = maxValue;
+      }
+    }
+
+    for (SizeType node = numInnerNodes; node-- > 0;) {
+      NumericType *box = &boxes[node * 2 * dim];
+      const NumericType *left = &boxes[(2 * node + 1) * 2 * dim];
+      const NumericType *right = &boxes[(2 * node + 2) * 2 * dim];
+      for (SizeType axis = 0; axis < dim; ++axis) {
+        box[axis] = std::min(left[axis], right[axis]);
+        box[dim + axis] = std::max(left[dim + axis], right[dim + axis]);
+      }
+    }
+    slack = 0.;
+  }
+
+  [[nodiscard]] NumericType getLeafExtent() const {
+    const SizeType dim = getDimension();
+    const SizeType numInnerNodes = splitAxes.size();
+    NumericType extent = 0.;
+    for (SizeType node = numInnerNodes; node <= 2 * numInnerNodes; ++node) {
+      const NumericType *box = &boxes[node * 2 * dim];
+      for (SizeType axis = 0; axis < dim; ++axis)
+        extent += box[dim + axis] - box[axis];
+    }
+    return extent;
+  }
+
+  // Partition the points in [begin, end) at the median of the axis with the
+  // largest extent.
+  void build(const SizeType node, const SizeType begin, const SizeType end,
+             const SizeType depth, const SizeType parallelDepth) {
+    if (depth == numLevels) {
+      leafOffsets[node - splitAxes.size()] = begin;
+      return;
+    }
+
+    unsigned char axis = 0;
+    NumericType maxExtent = -1.;
+    for (SizeType a = 0; a < getDimension(); ++a) {
+      const NumericType *axisCoordinates = &coordinates[a * numPoints];
+      NumericType minValue = std::numeric_limits<NumericType>::max();
+      NumericType maxValue = std::numeric_limits<NumericType>::lowest();
+      for (SizeType i = begin; i < end; ++i) {
+        minValue = std::min(minValue, axisCoordinates[indices[i]]);
+        maxValue = std::max(maxValue, axisCoordinates[indices[i]]);
+      }
+      if (maxValue - minValue > maxExtent) {
+        maxExtent = maxValue - minValue;
+        axis = static_cast<unsigned char>(a);
+      }
+    }
+
+    const SizeType middle = begin + (end - begin) / 2;
+    const NumericType *axisCoordinates = &coordinates[axis * numPoints];
+    std::nth_element(std::next(indices.begin(), begin),
+                     std::next(indices.begin(), middle),
+                     std::next(indices.begin(), end),
+                     [axisCoordinates](SizeType a, SizeType b) {
+                       return axisCoordinates[a] < axisCoordinates[b];
+                     });
+    splitAxes[node] = axis;
+    splitValues[node] = axisCoordinates[indices[middle]];
+
+#pragma omp task final(depth >= parallelDepth)
+    build(2 * node + 1, begin, middle, depth + 1, parallelDepth);
+    build(2 * node + 2, middle, end, depth + 1, parallelDepth);
+#pragma omp taskwait
+  }
+
+  /****************************************************************************
+   * Tree Traversal                                                           *
+   ****************************************************************************/
+
+  // Squared distance and position of the closest point.
+  [[nodiscard]] std::pair<NumericType, SizeType>
+  searchNearest(const PointType &x,
+                QueryStatistics *statistics = nullptr) const {
+    auto best = std::pair{std::numeric_limits<NumericType>::infinity(),
+                          SizeType(0)};
+    traverse(
+        x, [&best]() { return best.first; },
+        [&best](SizeType position, NumericType distance) {
+          if (distance < best.first)
+            best = std::pair{distance, position};
+        },
+        true, statistics);
+    return best;
+  }
+
+  void searchKNearest(const PointType &x,
+                      psBoundedPQueue<NumericType, SizeType> &queue,
+                      QueryStatistics *statistics = nullptr) const {
+    traverse(
+        x,
+        [&queue]() {
+          return queue.size() < queue.maxSize()
+                     ? std::numeric_limits<NumericType>::infinity()
+                     : queue.worst();
+        },
+        [&queue](SizeType position, NumericType distance) {
+          queue.enqueue(std::pair{distance, position});
+        },
+        true, statistics);
+  }
+
+  // Visits all leaves which can contain points closer to x than bound(), the
+  // closest leaves first. visit(position, squaredDistance) is called for each
+  // point of the visited leaves and for all inserted points. If approximate
+  // is set, the distances of the subtrees are multiplied by the
+  // approximation factor and at most maxLeafVisits leaves are visited.
+  template <class BoundFunction, class VisitFunction>
+  void traverse(const PointType &x, BoundFunction bound, VisitFunction visit,
+                const bool approximate,
+                QueryStatistics *statistics = nullptr) const {
+    const SizeType dim = getDimension();
+    const NumericType factor = approximate ? approximationFactor : 1;
+    const SizeType leafBudget = approximate && maxLeafVisits > 0
+                                    ? maxLeafVisits
+                                    : std::numeric_limits<SizeType>::max();
+    SizeType visitedNodes = 0;
+    SizeType visitedLeaves = 0;
+    SizeType visitedPoints = insertedIndices.size();
+    for (SizeType k = 0; k < insertedIndices.size(); ++k) {
+      NumericType distance = 0.;
+      for (SizeType axis = 0; axis < dim; ++axis) {
+        const NumericType diff =
+            insertedCoordinates[k * dim + axis] - x[axis];
+        distance += diff * diff;
+      }
+      visit(numPoints + k, distance);
+    }
+
+    struct Range {
+      SizeType node;
+      SizeType begin;
+      SizeType end;
+      NumericType distance; // squared lower bound of the distance
+    };
+    std::array<Range, maxDepth> stack;
+    SizeType stackSize = 0;
+    const NumericType rootDistance = splitsValid ? 0 : boxDistance(x, 0);
+    stack[stackSize++] = Range{0, 0, numPoints, rootDistance};
+
+    const SizeType numInnerNodes = splitAxes.size();
+    std::array<NumericType, leafSize> distances;
+    while (stackSize > 0 && visitedLeaves < leafBudget) {
+      auto range = stack[--stackSize];
+      if (range.distance * factor > bound())
+        continue;
+
+      // descend to the closest leaf, the other children are visited later
+      while (range.node < numInnerNodes) {
+        ++visitedNodes;
+        const SizeType middle = range.begin + (range.end - range.begin) / 2;
+        const SizeType left = 2 * range.node + 1;
+        const NumericType diff =
+            x[splitAxes[range.node]] - splitValues[range.node];
+        const auto leftRange = Range{left, range.begin, middle,
+                                     diff < 0 ? range.distance : diff * diff};
+        const auto rightRange = Range{left + 1, middle, range.end,
+                                      diff < 0 ? diff * diff : range.distance};
+        auto nearRange = diff < 0 ? leftRange : rightRange;
+        auto farRange = diff < 0 ? rightRange : leftRange;
+        if (!splitsValid) {
+          // the split values are outdated, so both distances are taken from
+          // the bounding boxes
+          nearRange.distance = boxDistance(x, nearRange.node);
+          farRange.distance = boxDistance(x, farRange.node);
+          if (farRange.distance < nearRange.distance)
+            std::swap(nearRange, farRange);
+        }
+        stack[stackSize++] = farRange;
+        range = nearRange;
+      }
+      if (range.distance * factor > bound())
+        continue;
+
+      const SizeType count = range.end - range.begin;
+      ++visitedNodes;
+      ++visitedLeaves;
+      visitedPoints += count;
+      leafDistances(x, range.begin, count, distances.data());
+      for (SizeType i = 0; i < count; ++i) {
+        if (numRemoved == 0 || !removed[range.begin + i])
+          visit(range.begin + i, distances[i]);
+      }
+    }
+
+    if (statistics)
+      *statistics = QueryStatistics{visitedNodes, visitedLeaves, visitedPoints};
+  }
+
+  // Squared distance of x to the bounding box of the node, enlarged by the
+  // movement of the points since the last refit.
+  [[nodiscard]] NumericType boxDistance(const PointType &x,
+                                        const SizeType node) const {
+    const SizeType dim = getDimension();
+    const NumericType *box = &boxes[node * 2 * dim];
+    NumericType distance = 0.;
+    for (SizeType axis = 0; axis < dim; ++axis) {
+      const NumericType diff =
+          std::max({box[axis] - slack - x[axis],
+                    x[axis] - box[dim + axis] - slack, NumericType(0)});
+      distance += diff * diff;
+    }
+    return distance;
+  }
+
+  // Squared distances of x to the points at the positions [begin, begin +
+  // count). The coordinates of each axis are contiguous, so the inner loop is
+  // vectorized.
+  void leafDistances(const PointType &x, const SizeType begin,
+                     const SizeType count, NumericType *distances) const {
+    for (SizeType i = 0; i < count; ++i)
+      distances[i] = 0.;
+    for (SizeType axis = 0; axis < getDimension(); ++axis) {
+      const NumericType *axisCoordinates =
+          &coordinates[axis * numPoints + begin];
+      const NumericType value = x[axis];
+#pragma omp simd
+      for (SizeType i = 0; i < count; ++i) {
+        const NumericType diff = axisCoordinates[i] - value;
+        distances[i] += diff * diff;
+      }
+    }
+  }
+
+  /****************************************************************************
+   * Serialization                                                            *
+   ****************************************************************************/
+
+  static constexpr char fileMagic[8] = {'P', 'S', 'K', 'D',
+                                        'T', 'R', 'E', 'E'};
+  static constexpr uint32_t fileVersion = 1;
+  static constexpr uint32_t byteOrderMark = 0x01020304;
+
+  // Read the content of a saved tree of fileSize bytes. The tree is only
+  // modified if the whole file is valid.
+  template <class ReadFunction>
+  bool readContent(ReadFunction &readBytes, const size_t fileSize,
+                   const uint64_t dataHash) {
+    size_t offset = 0;
+    auto read = [&readBytes, &offset](auto &value) {
+      if (!readBytes(offset, &value, sizeof(value)))
+        return false;
+      offset += sizeof(value);
+      return true;
+    };
+    // the size is checked against the rest of the file before allocating
+    auto readArray = [&readBytes, &offset, &read,
+                      fileSize](auto &values, const uint64_t size) {
+      uint64_t storedSize = 0;
+      if (!read(storedSize) || storedSize != size ||
+          size > (fileSize - offset) / sizeof(values[0]))
+        return false;
+      values.resize(size);
+      if (size > 0 &&
+          !readBytes(offset, values.data(), size * sizeof(values[0])))
+        return false;
+      offset += size * sizeof(values[0]);
+      return true;
+    };
+
+    char magic[sizeof(fileMagic)];
+    uint32_t version = 0, mark = 0, numericSize = 0, indexSize = 0;
+    uint32_t valid = 0;
+    uint64_t dimension = 0, pointCount = 0, levelCount = 0, hash = 0;
+    NumericType storedSlack = 0., leafExtent = 0.;
+    if (!(read(magic) &&
+          std::memcmp(magic, fileMagic, sizeof(fileMagic)) == 0 &&
+          read(version) && version == fileVersion && read(mark) &&
+          mark == byteOrderMark && read(numericSize) &&
+          numericSize == sizeof(NumericType) && read(indexSize) &&
+          indexSize == sizeof(SizeType) && read(dimension) &&
+          read(pointCount) && read(levelCount) && read(hash) &&
+          hash == dataHash && read(storedSlack) && read(leafExtent) &&
+          read(valid)))
+      return false;
+    if (dimension == 0 || pointCount == 0 ||
+        (staticDimension > 0 && dimension != staticDimension))
+      return false;
+    // the coordinates have to fit into the file, which also prevents an
+    // overflow of the array sizes below
+    if (pointCount > fileSize / sizeof(NumericType) / dimension)
+      return false;
+    // the depth has to be the one build uses for this number of points
+    uint64_t expectedLevels = 0;
+    while (((pointCount - 1) >> expectedLevels) + 1 > leafSize)
+      ++expectedLevels;
+    if (levelCount != expectedLevels)
+      return false;
+
+    const uint64_t numInnerNodes = (uint64_t(1) << levelCount) - 1;
+    std::vector<NumericType> factors, coords, values, nodeBoxes;
+    std::vector<SizeType> pointIndices, offsets;
+    std::vector<unsigned char> axes;
+    if (!(readArray(factors, dimension) &&
+          readArray(coords, dimension * pointCount) &&
+          readArray(pointIndices, pointCount) &&
+          readArray(axes, numInnerNodes) &&
+          readArray(values, numInnerNodes) &&
+          readArray(offsets, numInnerNodes + 2) &&
+          readArray(nodeBoxes, (2 * numInnerNodes + 1) * 2 * dimension)))
+      return false;
+
+    // the indices have to be a permutation of the points
+    std::vector<SizeType> pointPositions(pointCount, invalidPosition);
+    for (SizeType i = 0; i < pointCount; ++i) {
+      if (pointIndices[i] >= pointCount ||
+          pointPositions[pointIndices[i]] != invalidPosition)
+        return false;
+      pointPositions[pointIndices[i]] = i;
+    }
+    for (const auto axis : axes) {
+      if (axis >= dimension)
+        return false;
+    }
+    // the leaves have to partition the points into buckets of at most
+    // leafSize points
+    if (offsets.front() != 0 || offsets.back() != pointCount)
+      return false;
+    for (SizeType leaf = 0; leaf + 1 < offsets.size(); ++leaf) {
+      if (offsets[leaf + 1] < offsets[leaf] ||
+          offsets[leaf + 1] - offsets[leaf] > leafSize)
+        return false;
+    }
+
+    D = dimension;
+    numPoints = pointCount;
+    numLevels = levelCount;
+    slack = storedSlack;
+    builtLeafExtent = leafExtent;
+    splitsValid = valid != 0;
+    scalingFactors.swap(factors);
+    coordinates.swap(coords);
+    indices.swap(pointIndices);
+    positions.swap(pointPositions);
+    splitAxes.swap(axes);
+    splitValues.swap(values);
+    leafOffsets.swap(offsets);
+    boxes.swap(nodeBoxes);
+    removed.assign(numPoints, 0);
+    numRemoved = 0;
+    insertedIndices.clear();
+    insertedCoordinates.clear();
+    isBuilt = true;
+    return true;
+  }
+
+  /****************************************************************************
+   * Utility Functions                                                        *
+   ****************************************************************************/
+
+  // Order of the queries sorted by the leaf which contains them.
+  [[nodiscard]] std::vector<SizeType>
+  getQueryOrder(const ValueType *queries, const SizeType numQueries) const {
+    const SizeType numInnerNodes = splitAxes.size();
+    std::vector<SizeType> leaves(numQueries);
+    const long long count = numQueries;
+#pragma omp parallel for
+    for (long long i = 0; i < count; ++i) {
+      SizeType node = 0;
+      while (node < numInnerNodes) {
+        const auto axis = splitAxes[node];
+        node = 2 * node + 1 +
+               (scalingFactors[axis] * queries[i][axis] >= splitValues[node]);
+      }
+      leaves[i] = node;
+    }
+
+    std::vector<SizeType> order(numQueries);
+    for (SizeType i = 0; i < numQueries; ++i)
+      order[i] = i;
+    std::sort(order.begin(), order.end(), [&leaves](SizeType a, SizeType b) {
+      return leaves[a] < leaves[b];
+    });
+    return order;
+  }
+
+  // Index of the point at a position in the tree or the inserted points.
+  [[nodiscard]] SizeType getPointIndex(const SizeType position) const {
+    return position < numPoints ? indices[position]
+                                : insertedIndices[position - numPoints];
+  }
+
+  [[nodiscard]] PointType scalePoint(const ValueType &x) const {
+    PointType point{};
+    if constexpr (staticDimension == 0)
+      point.resize(D);
+    for (SizeType axis = 0; axis < getDimension(); ++axis)
+      point[axis] = scalingFactors[axis] * x[axis];
+    return point;
+  }
+
+  // Empties the queue into a vector of indices and distances, the closest
+  // point first.
+  template <class Q>
+  [[nodiscard]] std::vector<std::pair<SizeType, NumericType>>
+  toResult(Q &queue) const {
+    auto result = std::vector<std::pair<SizeType, NumericType>>();
+    result.reserve(queue.size());
+
+    while (!queue.empty()) {
+      const NumericType distance = queue.best();
+      const auto position = queue.dequeueBest();
+      result.emplace_back(getPointIndex(position), std::sqrt(distance));
+    }
+    return result;
+  }
+
+  // Quickly calculate the log2 of ints
+  template <typename Int,
+            typename = std::enable_if_t<std::is_integral_v<Int>>>
+  [[nodiscard]] static constexpr Int intLog2(Int x) {
+    Int val = 0;
+    while (x >>= 1)
+      ++val;
+    return val;
+  }
+};
+
+#endif
@@ -5,35 +5,34 @@
 #include <cmath>
 #include <numeric>
 #include <optional>
+#include <string>
 #include <tuple>
 #include <type_traits>
 #include <vector>
 
 #include <psDataScaler.hpp>
+#include <psDataTable.hpp>
 #include <psKDTree.hpp>
 #include <psSmartPointer.hpp>
+#include <psSpatialHash.hpp>
 #include <psValueEstimator.hpp>
 
-template <typename VectorType, typename SizeType>
-auto extractInputData(psSmartPointer<const VectorType> data, SizeType InputDim,
-                      SizeType OutputDim) {
-  VectorType inputData;
-  using ElementType = typename VectorType::value_type;
+template <typename NumericType, typename SizeType>
+auto extractInputData(psSmartPointer<const psDataTable<NumericType>> data,
+                      SizeType InputDim, SizeType OutputDim) {
+  std::vector<std::vector<NumericType>> inputData;
 
   inputData.reserve(data->size());
-  std::transform(data->begin(), data->end(), std::back_inserter(inputData),
-                 [=](const auto &d) {
-                   ElementType element;
-                   std::copy_n(d.begin(), InputDim,
-                               std::back_inserter(element));
-                   return element;
-                 });
+  for (SizeType i = 0; i < data->size(); ++i)
+    inputData.emplace_back(data->getRow(i), data->getRow(i) + InputDim);
   return inputData;
 }
 
-// Class providing nearest neighbors interpolation
+// Class providing nearest neighbors interpolation. The neighbors are found by
+// a psKDTree or, for data on a regular grid, a psSpatialHash.
 template <typename NumericType,
-          typename DataScaler = psStandardScaler<NumericType>>
+          typename DataScaler = psStandardScaler<NumericType>,
+          typename PointLocator = psKDTree<NumericType>>
 class psNearestNeighborsInterpolation
     : public psValueEstimator<NumericType, NumericType> {
 
@@ -51,10 +50,14 @@ class psNearestNeighborsInterpolation
   using Parent::inputDim;
   using Parent::outputDim;
 
-  psKDTree<NumericType> kdtree;
+  PointLocator locator;
 
   int numberOfNeighbors = 3.;
   NumericType distanceExponent = 2.;
+  std::string cacheFileName;
+
+  static constexpr bool hasSerializableLocator =
+      std::is_same_v<PointLocator, psKDTree<NumericType>>;
 
 public:
   psNearestNeighborsInterpolation() {}
@@ -67,6 +70,26 @@ public:
     distanceExponent = passedDistanceExponent;
   }
 
+  // Interpolate from (1 + epsilon) approximate nearest neighbors, see
+  // psKDTree::setApproximation.
+  void setApproximation(NumericType epsilon) {
+    locator.setApproximation(epsilon);
+  }
+
+  // Store the built kd-tree in a file, which is loaded instead of building
+  // the tree again as long as the input data does not change. The scaling of
+  // the data is stored with the tree.
+  void setCacheFile(const std::string &passedCacheFileName) {
+    if constexpr (!hasSerializableLocator) {
+      psLogger::getInstance()
+          .addWarning("psNearestNeighborsInterpolation: only kd-trees can be "
+                      "cached.")
+          .print();
+    } else {
+      cacheFileName = passedCacheFileName;
+    }
+  }
+
   bool initialize() override {
     if (!data || (data && data->empty())) {
       psLogger::getInstance()
@@ -76,7 +99,7 @@ public:
       return false;
     }
 
-    if (data->at(0).size() != inputDim + outputDim) {
+    if (data->getNumberOfColumns() != inputDim + outputDim) {
       psLogger::getInstance()
           .addWarning(
               "psNearestNeighborsInterpolation: the sum of the provided "
@@ -89,12 +112,19 @@ public:
     // Copy the first inputDim columns into a new vector
     auto inputData = extractInputData(data, inputDim, outputDim);
 
-    DataScaler scaler(inputData);
-    scaler.apply();
-    auto scalingFactors = scaler.getScalingFactors();
+    if constexpr (hasSerializableLocator) {
+      if (!cacheFileName.empty()) {
+        const auto dataHash = locator.computeDataHash(inputData);
+        if (!locator.load(cacheFileName, dataHash)) {
+          buildLocator(inputData);
+          locator.save(cacheFileName, dataHash);
+        }
+        dataChanged = false;
+        return true;
+      }
+    }
 
-    kdtree.setPoints(inputData, scalingFactors);
-    kdtree.build();
+    buildLocator(inputData);
 
     dataChanged = false;
 
@@ -115,7 +145,7 @@ public:
       if (!initialize())
         return {};
 
-    auto neighborsOpt = kdtree.findKNearest(input, numberOfNeighbors);
+    auto neighborsOpt = locator.findKNearest(input, numberOfNeighbors);
     if (!neighborsOpt)
       return {};
 
@@ -132,16 +162,17 @@ public:
       minDistance = std::min({distance, minDistance});
 
       NumericType weight;
+      const NumericType *values = data->getRow(nearestIndex) + inputDim;
       if (distance == 0) {
         for (int i = 0; i < outputDim; ++i)
-          result[i] = data->at(nearestIndex).at(inputDim + i);
+          result[i] = values[i];
         weightSum = 1.;
         break;
       } else {
         weight = std::pow(1. / distance, distanceExponent);
       }
       for (int i = 0; i < outputDim; ++i)
-        result[i] += weight * data->at(nearestIndex).at(inputDim + i);
+        result[i] += weight * values[i];
 
       weightSum += weight;
     }
@@ -151,6 +182,16 @@ public:
 
     return {{result, minDistance}};
   }
+
+private:
+  void buildLocator(const std::vector<ItemType> &inputData) {
+    DataScaler scaler(inputData);
+    scaler.apply();
+    auto scalingFactors = scaler.getScalingFactors();
+
+    locator.setPoints(inputData, scalingFactors);
+    locator.build();
+  }
 };
 
 #endif
\ No newline at end of file
@@ -7,119 +7,186 @@
  * URL: https://www.keithschwarz.com/interesting/
  */
 
+#include <algorithm>
 #include <functional>
 #include <limits>
-#include <map>
 #include <utility>
+#include <vector>
 
 // A bounded priority queue implementation.
 // If a certain predifined number of elements are already stored in the queue,
 // then a new item with a worse value than the worst already in the queue won't
 // be added when enqueue is called with the new item.
+// The items are kept in a binary max-heap (worst item on top) in a buffer
+// which is allocated once, so enqueuing does not allocate. The items are
+// sorted when the first one is dequeued.
 template <class K, class V, typename Comparator = std::less<K>>
 struct psBoundedPQueue {
-  using MapType = std::multimap<K, V, Comparator>;
+  using ItemType = std::pair<K, V>;
   using SizeType = std::size_t;
 
 private:
-  MapType mmap;
+  std::vector<ItemType> items;
+  SizeType first = 0; // first item which was not dequeued yet
+  bool isSorted = false;
   const SizeType maximumSize;
+  Comparator comparator;
 
 public:
   psBoundedPQueue(SizeType passedMaximumSize)
-      : maximumSize(passedMaximumSize) {}
+      : maximumSize(passedMaximumSize) {
+    items.reserve(maximumSize);
+  }
 
-  void enqueue(std::pair<K, V> &&item) {
-    // Optimization: If this isn't going to be added, don't add it.
-    if (size() == maxSize() && mmap.key_comp()(worst(), item.first))
+  void enqueue(ItemType &&item) {
+    if (maxSize() == 0)
       return;
-
-    // Add the element to the collection.
-    mmap.emplace(std::forward<std::pair<K, V>>(item));
-
-    // If there are too many elements in the queue, drop off the last one.
-    if (size() > maxSize()) {
-      auto last = mmap.end();
-      --last; // Now points to highest-priority element
-      mmap.erase(last);
+    if (isSorted)
+      restoreHeap();
+
+    if (items.size() < maxSize()) {
+      items.push_back(std::move(item));
+      std::push_heap(items.begin(), items.end(), compareItems());
+    } else if (comparator(item.first, items.front().first)) {
+      // replace the worst item
+      std::pop_heap(items.begin(), items.end(), compareItems());
+      items.back() = std::move(item);
+      std::push_heap(items.begin(), items.end(), compareItems());
     }
   }
 
   V dequeueBest() {
-    // Copy the best value.
-    V result = mmap.begin()->second;
-
-    // Remove it from the map.
-    mmap.erase(mmap.begin());
+    if (!isSorted) {
+      std::sort_heap(items.begin(), items.end(), compareItems());
+      isSorted = true;
+    }
+    return items[first++].second;
+  }
 
-    return result;
+  void clear() {
+    items.clear();
+    first = 0;
+    isSorted = false;
   }
 
   [[nodiscard]] SizeType maxSize() const { return maximumSize; }
 
-  [[nodiscard]] SizeType size() const { return mmap.size(); }
+  [[nodiscard]] SizeType size() const { return items.size() - first; }
 
-  [[nodiscard]] bool empty() const { return mmap.empty(); }
+  [[nodiscard]] bool empty() const { return size() == 0; }
 
   [[nodiscard]] K best() const {
-    return mmap.empty() ? std::numeric_limits<K>::infinity()
-                        : mmap.begin()->first;
+    if (empty())
+      return std::numeric_limits<K>::infinity();
+    if (isSorted)
+      return items[first].first;
+    return std::min_element(items.begin(), items.end(), compareItems())->first;
   }
 
   [[nodiscard]] K worst() const {
-    return mmap.empty() ? std::numeric_limits<K>::infinity()
-                        : mmap.rbegin()->first;
+    if (empty())
+      return std::numeric_limits<K>::infinity();
+    return isSorted ? items.back().first : items.front().first;
+  }
+
+private:
+  auto compareItems() const {
+    return [this](const ItemType &a, const ItemType &b) {
+      return comparator(a.first, b.first);
+    };
+  }
+
+  // Remove the dequeued items and turn the sorted items into a heap again.
+  void restoreHeap() {
+    items.erase(items.begin(), items.begin() + first);
+    std::make_heap(items.begin(), items.end(), compareItems());
+    first = 0;
+    isSorted = false;
   }
 };
 
 // A clamped priority queue implementation.
 // Only items whose value is better than that of a predefined threshold can be
 // added to the queue.
+// The items are appended to a buffer and only sorted when the first one is
+// dequeued. The buffer keeps its capacity, so a queue which is cleared and
+// reused does not allocate again.
 template <class K, class V, typename Comparator = std::less<K>>
 struct psClampedPQueue {
-  using MapType = std::multimap<K, V, Comparator>;
+  using ItemType = std::pair<K, V>;
   using SizeType = std::size_t;
 
 private:
-  MapType mmap;
+  std::vector<ItemType> items;
+  SizeType first = 0; // first item which was not dequeued yet
+  bool isSorted = true;
   const K thresValue;
+  Comparator comparator;
 
 public:
-  psClampedPQueue(K passedThresValue) : thresValue(passedThresValue) {}
+  psClampedPQueue(K passedThresValue, SizeType expectedSize = 0)
+      : thresValue(passedThresValue) {
+    items.reserve(expectedSize);
+  }
 
-  void enqueue(std::pair<K, V> &&item) {
+  void enqueue(ItemType &&item) {
     // Optimization: If this isn't going to be added, don't add it.
-    if (mmap.key_comp()(thresValue, item.first))
+    if (comparator(thresValue, item.first))
       return;
 
-    // Add the element to the collection.
-    mmap.emplace(std::forward<std::pair<K, V>>(item));
+    items.push_back(std::move(item));
+    isSorted = false;
   }
 
   V dequeueBest() {
-    // Copy the best value.
-    V result = mmap.begin()->second;
-
-    // Remove it from the map.
-    mmap.erase(mmap.begin());
+    sort();
+    return items[first++].second;
+  }
 
-    return result;
+  void clear() {
+    items.clear();
+    first = 0;
+    isSorted = true;
   }
 
   [[nodiscard]] K thresholdValue() const { return thresValue; }
 
-  [[nodiscard]] SizeType size() const { return mmap.size(); }
+  [[nodiscard]] SizeType size() const { return items.size() - first; }
 
-  [[nodiscard]] bool empty() const { return mmap.empty(); }
+  [[nodiscard]] bool empty() const { return size() == 0; }
 
   [[nodiscard]] K best() const {
-    return mmap.empty() ? std::numeric_limits<K>::infinity()
-                        : mmap.begin()->first;
+    if (empty())
+      return std::numeric_limits<K>::infinity();
+    if (isSorted)
+      return items[first].first;
+    return std::min_element(items.begin() + first, items.end(),
+                            compareItems())
+        ->first;
   }
 
   [[nodiscard]] K worst() const {
-    return mmap.empty() ? std::numeric_limits<K>::infinity()
-                        : mmap.rbegin()->first;
+    if (empty())
+      return std::numeric_limits<K>::infinity();
+    if (isSorted)
+      return items.back().first;
+    return std::max_element(items.begin() + first, items.end(),
+                            compareItems())
+        ->first;
+  }
+
+private:
+  auto compareItems() const {
+    return [this](const ItemType &a, const ItemType &b) {
+      return comparator(a.first, b.first);
+    };
+  }
+
+  void sort() {
+    if (isSorted)
+      return;
+    std::sort(items.begin() + first, items.end(), compareItems());
+    isSorted = true;
   }
 };
-#endif
\ No newline at end of file
+#endif
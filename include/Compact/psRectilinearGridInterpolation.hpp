@@ -3,13 +3,15 @@
 
 #include <algorithm>
 #include <array>
-#include <set>
+#include <cmath>
 #include <vector>
 
 #include <psLogger.hpp>
 #include <psValueEstimator.hpp>
 
-// Class providing linear interpolation on rectilinear data grids
+// Class providing linear interpolation on rectilinear data grids. The grid
+// coordinates of each axis are stored in a sorted array and the values of all
+// grid points in one dense array, with the last axis varying fastest.
 template <typename NumericType>
 class psRectilinearGridInterpolation
     : public psValueEstimator<NumericType, bool> {
@@ -25,8 +27,16 @@ class psRectilinearGridInterpolation
   using Parent::inputDim;
   using Parent::outputDim;
 
-  std::vector<std::set<NumericType>> uniqueValues;
-  VectorType localData;
+  // sorted grid coordinates of each axis
+  std::vector<std::vector<NumericType>> gridCoordinates;
+  // axes with (nearly) equidistant coordinates, whose cell is computed
+  // directly from the coordinate
+  std::vector<char> isUniform;
+  std::vector<NumericType> inverseSpacing;
+  // distance between neighboring grid points along each axis in the values
+  std::vector<SizeType> strides;
+  // outputDim values per grid point
+  std::vector<NumericType> values;
 
   // For rectilinear grid interpolation to work, we first have to ensure that
   // our input coordinates are arranged in a certain way
@@ -40,7 +50,7 @@ class psRectilinearGridInterpolation
       return equalSize;
 
     auto size = std::distance(start, end);
-    if (size > 1) {
+    if (size > 0) {
       // Now sort the data along the given axis
       std::sort(start, end, [&](const auto &a, const auto &b) {
         return a[axis] < b[axis];
@@ -51,7 +61,7 @@ class psRectilinearGridInterpolation
       std::vector<size_t> rangeBreaks;
       rangeBreaks.push_back(0);
       if (capture)
-        uniqueValues[axis].insert(start->at(axis));
+        gridCoordinates[axis].push_back(start->at(axis));
 
       for (unsigned i = 1; i < size; ++i)
         if ((start + i - 1)->at(axis) != (start + i)->at(axis)) {
@@ -61,7 +71,8 @@ class psRectilinearGridInterpolation
           size_t tmp = rangeBreaks.back();
 
           rangeBreaks.push_back(i);
-          uniqueValues[axis].insert((start + i)->at(axis));
+          if (capture)
+            gridCoordinates[axis].push_back((start + i)->at(axis));
 
           if (rangeSize != i - tmp) {
             psLogger::getInstance()
@@ -86,6 +97,89 @@ class psRectilinearGridInterpolation
     return equalSize;
   }
 
+  // Index of the grid point below x along the axis, such that x lies in
+  // [coordinates[index], coordinates[index + 1]), clamped to the cells of
+  // the axis.
+  SizeType findCell(const SizeType axis, const NumericType x) const {
+    const auto &coordinates = gridCoordinates[axis];
+    const SizeType lastCell = coordinates.size() - 2;
+    if (!isUniform[axis]) {
+      const auto upper = std::upper_bound(coordinates.begin() + 1,
+                                          coordinates.end() - 1, x);
+      return std::distance(coordinates.begin(), upper) - 1;
+    }
+
+    // the guess is off by at most one cell for nearly uniform axes
+    const NumericType guess = (x - coordinates[0]) * inverseSpacing[axis];
+    SizeType index =
+        guess > 0 ? static_cast<SizeType>(
+                        std::min(guess, static_cast<NumericType>(lastCell)))
+                  : 0;
+    while (index > 0 && x < coordinates[index])
+      --index;
+    while (index < lastCell && x >= coordinates[index + 1])
+      ++index;
+    return index;
+  }
+
+  // Interpolates the outputDim values at the input coordinates and returns
+  // whether the input is inside of the grid. lowerIndices and weights have to
+  // hold inputDim values and are used as scratch space.
+  bool interpolate(const NumericType *input, NumericType *output,
+                   SizeType *lowerIndices, NumericType *weights) const {
+    bool isInside = true;
+    SizeType baseIndex = 0;
+    for (SizeType axis = 0; axis < inputDim; ++axis) {
+      const auto &coordinates = gridCoordinates[axis];
+      const NumericType x = input[axis];
+      if (x < coordinates.front() || x > coordinates.back())
+        isInside = false;
+
+      // weights[axis] is the weight of the upper grid point, inputs outside
+      // of the grid use the values at its boundary
+      if (coordinates.size() == 1 || x <= coordinates.front()) {
+        lowerIndices[axis] = 0;
+        weights[axis] = 0.;
+      } else if (x >= coordinates.back()) {
+        lowerIndices[axis] = coordinates.size() - 2;
+        weights[axis] = 1.;
+      } else {
+        const SizeType index = findCell(axis, x);
+        lowerIndices[axis] = index;
+        weights[axis] = (x - coordinates[index]) /
+                        (coordinates[index + 1] - coordinates[index]);
+      }
+      baseIndex += lowerIndices[axis] * strides[axis];
+    }
+
+    for (SizeType dim = 0; dim < outputDim; ++dim)
+      output[dim] = 0.;
+
+    // Each bit of a corner selects the lower (0) or upper (1) grid point
+    // along an axis
+    for (SizeType corner = 0; corner < (SizeType(1) << inputDim); ++corner) {
+      NumericType weight = 1.;
+      SizeType index = baseIndex;
+      for (SizeType axis = 0; axis < inputDim; ++axis) {
+        if ((corner >> axis) & 1) {
+          weight *= weights[axis];
+          if (gridCoordinates[axis].size() > 1)
+            index += strides[axis];
+        } else {
+          weight *= 1 - weights[axis];
+        }
+      }
+      if (weight == 0)
+        continue;
+
+      const NumericType *cornerValues = &values[index * outputDim];
+      for (SizeType dim = 0; dim < outputDim; ++dim)
+        output[dim] += weight * cornerValues[dim];
+    }
+
+    return isInside;
+  }
+
 public:
   psRectilinearGridInterpolation() {}
 
@@ -98,21 +192,19 @@ public:
       return false;
     }
 
-    if (data->at(0).size() != inputDim + outputDim) {
+    if (data->getNumberOfColumns() != inputDim + outputDim) {
       psLogger::getInstance()
           .addWarning(
-              "psNearestNeighborsInterpolation: the sum of the provided "
+              "psRectilinearGridInterpolation: the sum of the provided "
               "InputDimension and OutputDimension does not match the "
               "dimension of the provided data.")
           .print();
       return false;
     }
 
-    localData.clear();
-    localData.reserve(data->size());
-    std::copy(data->begin(), data->end(), std::back_inserter(localData));
+    VectorType localData = data->toVector();
 
-    uniqueValues.resize(inputDim);
+    gridCoordinates.assign(inputDim, {});
 
     auto equalSize = rearrange(localData.begin(), localData.end(), 0, true);
 
@@ -124,7 +216,7 @@ public:
     }
 
     for (int i = 0; i < inputDim; ++i)
-      if (uniqueValues[i].empty()) {
+      if (gridCoordinates[i].empty()) {
         psLogger::getInstance()
             .addWarning("The grid has no values along dimension " +
                         std::to_string(i))
@@ -132,6 +224,54 @@ public:
         return false;
       }
 
+    // The sorted data has to contain each combination of the grid
+    // coordinates exactly once
+    strides.resize(inputDim);
+    SizeType numGridPoints = 1;
+    for (int axis = inputDim - 1; axis >= 0; --axis) {
+      strides[axis] = numGridPoints;
+      numGridPoints *= gridCoordinates[axis].size();
+    }
+    bool isGrid = numGridPoints == localData.size();
+    for (SizeType i = 0; isGrid && i < localData.size(); ++i) {
+      for (SizeType axis = 0; axis < inputDim; ++axis) {
+        const auto &coordinates = gridCoordinates[axis];
+        if (localData[i][axis] !=
+            coordinates[(i / strides[axis]) % coordinates.size()]) {
+          isGrid = false;
+          break;
+        }
+      }
+    }
+    if (!isGrid) {
+      psLogger::getInstance()
+          .addWarning("Data is not arranged in a rectilinear grid!")
+          .print();
+      return false;
+    }
+
+    values.resize(numGridPoints * outputDim);
+    for (SizeType i = 0; i < numGridPoints; ++i)
+      std::copy(localData[i].begin() + inputDim, localData[i].end(),
+                values.begin() + i * outputDim);
+
+    isUniform.assign(inputDim, 0);
+    inverseSpacing.assign(inputDim, 0.);
+    for (SizeType axis = 0; axis < inputDim; ++axis) {
+      const auto &coordinates = gridCoordinates[axis];
+      const SizeType numCells = coordinates.size() - 1;
+      if (numCells < 2)
+        continue;
+      const NumericType spacing =
+          (coordinates.back() - coordinates.front()) / numCells;
+      bool uniform = true;
+      for (SizeType k = 1; uniform && k < numCells; ++k)
+        uniform = std::abs(coordinates[k] - coordinates[0] - k * spacing) <
+                  0.5 * spacing;
+      isUniform[axis] = uniform;
+      inverseSpacing[axis] = 1 / spacing;
+    }
+
     dataChanged = false;
     return true;
   }
@@ -142,100 +282,52 @@ public:
       if (!initialize())
         return {};
 
-    bool isInside = true;
-    for (int i = 0; i < inputDim; ++i)
-      if (!uniqueValues[i].empty()) {
-        // Check if the input lies within the bounds of our data grid
-        if (input[i] < *(uniqueValues[i].begin()) ||
-            input[i] > *(uniqueValues[i].rbegin())) {
-          isInside = false;
-        }
-      } else {
-        return {};
-      }
-
-    std::vector<SizeType> gridIndices(inputDim, 0);
-    std::vector<NumericType> normalizedCoordinates(inputDim, 0.);
-
-    // Check in which hyperrectangle the provided input coordinates are located
-    for (int i = 0; i < inputDim; ++i) {
-      if (input[i] <= *uniqueValues[i].begin()) {
-        // The coordinate is lower than or equal to the lowest grid point along
-        // the axis i.
-        gridIndices[i] = 0;
-        normalizedCoordinates[i] = 0;
-      } else if (input[i] >= *uniqueValues[i].rbegin()) {
-        // The coordinate is greater than or equal to the greatest grid point
-        // along the axis i.
-        gridIndices[i] = uniqueValues[i].size() - 1;
-        normalizedCoordinates[i] = 1.;
-      } else {
-        // The corrdinate is somewhere in between (excluding) the lowest and
-        // greatest grid point.
-
-        // The following function returns an iterator pointing to the first
-        // element that is greater than input[i].
-        auto upperIt = uniqueValues[i].upper_bound(input[i]);
+    if (input.size() < inputDim)
+      return {};
 
-        // Get the index of the lower bound (upper bound index - 1)
-        gridIndices[i] = std::distance(uniqueValues[i].begin(), upperIt) - 1;
+    ItemType result(outputDim, 0.);
+    std::vector<SizeType> lowerIndices(inputDim);
+    std::vector<NumericType> weights(inputDim);
+    const bool isInside = interpolate(input.data(), result.data(),
+                                      lowerIndices.data(), weights.data());
 
-        NumericType upperBound = *upperIt;
-        NumericType lowerBound = *(--upperIt);
-        normalizedCoordinates[i] =
-            (input[i] - lowerBound) / (upperBound - lowerBound);
-      }
-    }
+    return {{result, isInside}};
+  }
 
-    // Now retrieve the values at the corners of the selected hyperrectangle
-    std::vector<std::vector<NumericType>> cornerValues(
-        1 << inputDim, std::vector<NumericType>(outputDim, 0.));
-
-    for (int i = 0; i < cornerValues.size(); ++i) {
-      size_t index = 0;
-      size_t stepsize = 1;
-
-      for (int j = inputDim - 1; j >= 0; --j) {
-        // To get all combinations of corners of the hyperrectangle, we say
-        // that each bit in the i variable corresponds to an axis. A zero
-        // bit at a certain location represents a lower bound of the
-        // hyperrectangle along the axis and a one represents the upper
-        // bound.
-        int lower = (i >> j) & 1;
-
-        // If the grid index is at the maximum in this axis, always mark this
-        // point as the lower point (thus if the input lies at or outside of the
-        // upper edge boundary of the grid in the given axis, we use the same
-        // corner multiple times)
-        if (gridIndices[j] == uniqueValues[j].size() - 1)
-          lower = 1;
-
-        // If it is a lower bound, use the grid index itself, otherwise add
-        // 1 to the index (= index of upper bound along that axis)
-        index += (gridIndices[j] + (1 - lower)) * stepsize;
-        stepsize *= uniqueValues[j].size();
-      }
-      const auto &corner = localData.at(index);
-      std::copy(corner.cbegin() + inputDim, corner.cend(),
-                cornerValues[i].begin());
-    }
+  // Interpolate the values at numInputs points in parallel. The coordinates
+  // of input i are read from inputs[i * inputDim], its outputDim values are
+  // written to outputs[i * outputDim] and whether it is inside of the grid to
+  // isInside[i], if isInside is not nullptr. Returns false if the data could
+  // not be initialized.
+  bool estimateBatch(const NumericType *inputs, const SizeType numInputs,
+                     NumericType *outputs, bool *isInside = nullptr) {
+    if (dataChanged)
+      if (!initialize())
+        return false;
 
-    // Now do the actual linear interpolation
-    std::vector<NumericType> result(outputDim, 0.);
-    for (int dim = 0; dim < outputDim; ++dim) {
-      for (int i = inputDim - 1; i >= 0; --i) {
-        int stride = 1 << i;
-        for (int j = 0; j < stride; ++j) {
-          cornerValues[j][dim] =
-              normalizedCoordinates[i] * cornerValues[j][dim] +
-              (1 - normalizedCoordinates[i]) * cornerValues[j + stride][dim];
-        }
+    const long long count = numInputs;
+#pragma omp parallel
+    {
+      std::vector<SizeType> lowerIndices(inputDim);
+      std::vector<NumericType> weights(inputDim);
+#pragma omp for schedule(static)
+      for (long long i = 0; i < count; ++i) {
+        const bool inside =
+            interpolate(&inputs[i * inputDim], &outputs[i * outputDim],
+                        lowerIndices.data(), weights.data());
+        if (isInside)
+          isInside[i] = inside;
       }
-      result[dim] = cornerValues[0][dim];
     }
+    return true;
+  }
 
-    return {{result, isInside}};
+  bool estimateBatch(const std::vector<NumericType> &inputs,
+                     std::vector<NumericType> &outputs) {
+    const SizeType numInputs = inputDim > 0 ? inputs.size() / inputDim : 0;
+    outputs.resize(numInputs * outputDim);
+    return estimateBatch(inputs.data(), numInputs, outputs.data());
   }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,660 @@
+#ifndef PS_SPATIAL_HASH_HPP
+#define PS_SPATIAL_HASH_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+#include <psKDTree.hpp>
+#include <psLogger.hpp>
+#include <psQueues.hpp>
+
+/// Spatial hash for points which are spaced roughly uniformly, like the points
+/// of a disk mesh or the centers of the cells of a cell set. The (scaled)
+/// coordinates are quantized to cubic cells and the points are sorted by the
+/// hash of their cell, so the points of each cell are stored contiguously.
+/// The rows of cells along the first axis are hashed to random buckets, but
+/// the cells of a row are kept in consecutive buckets, so they are scanned at
+/// once. If the grid has few cells compared to the number of points, there is
+/// one bucket per cell. Queries visit the cells in shells of increasing
+/// distance around the query point. The interface is the same as the one of
+/// psKDTree, so both can be used interchangeably.
+template <class NumericType, class ValueType = std::vector<NumericType>>
+class psSpatialHash {
+  typedef typename std::vector<NumericType>::size_type SizeType;
+
+  static constexpr SizeType staticDimension =
+      psKDTreeDimension<ValueType>::value;
+
+  using PointType = std::conditional_t<(staticDimension > 0),
+                                       std::array<NumericType, staticDimension>,
+                                       std::vector<NumericType>>;
+  using CellType = std::conditional_t<(staticDimension > 0),
+                                      std::array<long long, staticDimension>,
+                                      std::vector<long long>>;
+
+  SizeType D = staticDimension;
+  SizeType numPoints = 0;
+  bool isBuilt = false;
+  std::vector<NumericType> scalingFactors;
+  // requested edge length of the cells, 0 to estimate it from the points
+  NumericType cellSize = 0.;
+
+  // the cells cover the bounding box of the points, starting at origin
+  NumericType cellExtent = 1.;
+  NumericType inverseCellExtent = 1.;
+  std::vector<NumericType> origin;
+  std::vector<long long> gridSize;
+  std::vector<uint64_t> strides;
+
+  // scaled coordinates, D values per point, sorted by the bucket of the
+  // points
+  std::vector<NumericType> coordinates;
+  // index of the point in the passed points vector and linear index of its
+  // cell, which separates the cells sharing a bucket
+  std::vector<SizeType> indices;
+  std::vector<uint64_t> cellKeys;
+  // first point of each bucket and the end of the last bucket
+  std::vector<SizeType> bucketOffsets;
+  uint64_t numBuckets = 1; // a power of two
+  bool isDense = false;    // one bucket per cell
+  static constexpr NumericType maxCellsPerPoint = 4;
+  // (1 + epsilon)^2 of the approximate search
+  NumericType approximationFactor = 1.;
+
+public:
+  psSpatialHash() {}
+
+  psSpatialHash(const std::vector<ValueType> &passedPoints) {
+    setPoints(passedPoints);
+  }
+
+  void setPoints(const std::vector<ValueType> &passedPoints,
+                 const std::vector<NumericType> &passedScalingFactors = {}) {
+    isBuilt = false;
+    if (passedPoints.empty()) {
+      psLogger::getInstance()
+          .addWarning("psSpatialHash: the provided points vector is empty.")
+          .print();
+      return;
+    }
+
+    if constexpr (staticDimension == 0)
+      D = passedPoints[0].size();
+
+    if (passedScalingFactors.empty()) {
+      scalingFactors = std::vector<NumericType>(D, 1.);
+    } else {
+      assert(
+          passedScalingFactors.size() == D &&
+          "The provided scaling factors have a different dimensionality than "
+          "the data.");
+      scalingFactors = passedScalingFactors;
+    }
+
+    numPoints = passedPoints.size();
+    coordinates.resize(numPoints * getDimension());
+    const long long n = numPoints;
+#pragma omp parallel for
+    for (long long i = 0; i < n; ++i) {
+      for (SizeType axis = 0; axis < getDimension(); ++axis)
+        coordinates[i * getDimension() + axis] =
+            scalingFactors[axis] * passedPoints[i][axis];
+    }
+  }
+
+  // Edge length of the cells in scaled coordinates. The spacing of the points
+  // is a good choice, e.g. the grid delta for disk mesh points. If it is not
+  // set, it is estimated from the bounding box of the points.
+  void setCellSize(const NumericType passedCellSize) {
+    cellSize = passedCellSize;
+  }
+
+  [[nodiscard]] NumericType getCellSize() const { return cellExtent; }
+
+  // Enables the (1 + epsilon) approximate search for the nearest and k
+  // nearest neighbors, like psKDTree::setApproximation. Radius queries always
+  // stay exact.
+  void setApproximation(const NumericType epsilon) {
+    const NumericType factor = 1 + std::max(epsilon, NumericType(0));
+    approximationFactor = factor * factor;
+  }
+
+  [[nodiscard]] SizeType getDimension() const {
+    if constexpr (staticDimension > 0)
+      return staticDimension;
+    else
+      return D;
+  }
+
+  [[nodiscard]] SizeType size() const { return numPoints; }
+
+  // Move the points to the given coordinates. Building the hash only takes
+  // linear time, so the points are simply sorted again.
+  void updatePoints(const std::vector<ValueType> &passedPoints,
+                    const NumericType = 0.) {
+    const auto factors = scalingFactors;
+    setPoints(passedPoints, factors);
+    build();
+  }
+
+  [[nodiscard]] std::optional<std::pair<SizeType, NumericType>>
+  findNearest(const ValueType &x) const {
+    if (!isBuilt)
+      return {};
+
+    const auto best = searchNearest(scalePoint(x));
+    return std::pair{indices[best.second], std::sqrt(best.first)};
+  }
+
+  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
+  findKNearest(const ValueType &x, const int k) const {
+    if (!isBuilt)
+      return {};
+
+    auto queue = psBoundedPQueue<NumericType, SizeType>(k);
+    searchKNearest(scalePoint(x), queue);
+    return toResult(queue);
+  }
+
+  [[nodiscard]] std::optional<std::vector<std::pair<SizeType, NumericType>>>
+  findNearestWithinRadius(const ValueType &x, const NumericType radius) const {
+    if (!isBuilt)
+      return {};
+
+    const NumericType radiusSquared = radius * radius;
+    auto queue = psClampedPQueue<NumericType, SizeType>(radiusSquared);
+    traverse(
+        scalePoint(x), [radiusSquared]() { return radiusSquared; },
+        [&queue](SizeType position, NumericType distance) {
+          queue.enqueue(std::pair{distance, position});
+        },
+        false);
+
+    return toResult(queue);
+  }
+
+  // Nearest neighbor of each query point, see psKDTree::findNearestBatch. The
+  // queries are processed in the order of the buckets they fall into.
+  void findNearestBatch(const ValueType *queries, const SizeType numQueries,
+                        SizeType *nearestIndices,
+                        NumericType *distances) const {
+    if (!isBuilt)
+      return;
+
+    const auto order = getQueryOrder(queries, numQueries);
+    const long long count = numQueries;
+#pragma omp parallel for schedule(dynamic, 256)
+    for (long long j = 0; j < count; ++j) {
+      const auto i = order[j];
+      const auto best = searchNearest(scalePoint(queries[i]));
+      nearestIndices[i] = indices[best.second];
+      distances[i] = std::sqrt(best.first);
+    }
+  }
+
+  void findNearestBatch(const std::vector<ValueType> &queries,
+                        std::vector<SizeType> &nearestIndices,
+                        std::vector<NumericType> &distances) const {
+    nearestIndices.resize(queries.size());
+    distances.resize(queries.size());
+    findNearestBatch(queries.data(), queries.size(), nearestIndices.data(),
+                     distances.data());
+  }
+
+  // The k nearest neighbors of each query point, see
+  // psKDTree::findKNearestBatch.
+  void findKNearestBatch(const ValueType *queries, const SizeType numQueries,
+                         const int k, SizeType *nearestIndices,
+                         NumericType *distances) const {
+    if (!isBuilt || k <= 0)
+      return;
+
+    const auto order = getQueryOrder(queries, numQueries);
+    const long long count = numQueries;
+#pragma omp parallel
+    {
+      auto queue = psBoundedPQueue<NumericType, SizeType>(k);
+#pragma omp for schedule(dynamic, 256)
+      for (long long j = 0; j < count; ++j) {
+        const auto i = order[j];
+        queue.clear();
+        searchKNearest(scalePoint(queries[i]), queue);
+
+        for (SizeType n = i * k; n < (i + 1) * k; ++n) {
+          if (queue.empty()) {
+            nearestIndices[n] = numPoints;
+            distances[n] = std::numeric_limits<NumericType>::infinity();
+          } else {
+            distances[n] = std::sqrt(queue.best());
+            nearestIndices[n] = indices[queue.dequeueBest()];
+          }
+        }
+      }
+    }
+  }
+
+  void findKNearestBatch(const std::vector<ValueType> &queries, const int k,
+                         std::vector<SizeType> &nearestIndices,
+                         std::vector<NumericType> &distances) const {
+    nearestIndices.resize(queries.size() * std::max(k, 0));
+    distances.resize(queries.size() * std::max(k, 0));
+    findKNearestBatch(queries.data(), queries.size(), k,
+                      nearestIndices.data(), distances.data());
+  }
+
+  void build() {
+    isBuilt = false;
+    if (numPoints == 0) {
+      psLogger::getInstance()
+          .addWarning("psSpatialHash: No points provided!")
+          .print();
+      return;
+    }
+    const SizeType dim = getDimension();
+    const long long n = numPoints;
+
+    // bounding box of the points
+    origin.resize(dim);
+    std::vector<NumericType> extents(dim);
+    for (SizeType axis = 0; axis < dim; ++axis) {
+      NumericType minimum = coordinates[axis];
+      NumericType maximum = coordinates[axis];
+#pragma omp parallel for reduction(min : minimum) reduction(max : maximum)
+      for (long long i = 0; i < n; ++i) {
+        minimum = std::min(minimum, coordinates[i * dim + axis]);
+        maximum = std::max(maximum, coordinates[i * dim + axis]);
+      }
+      origin[axis] = minimum;
+      extents[axis] = maximum - minimum;
+    }
+
+    cellExtent = cellSize > 0. ? cellSize : estimateCellSize(extents);
+    // the linear cell indices have to fit into 62 bits
+    long double numCells = 1.;
+    while (true) {
+      gridSize.resize(dim);
+      strides.resize(dim);
+      numCells = 1.;
+      for (SizeType axis = 0; axis < dim; ++axis) {
+        gridSize[axis] = static_cast<long long>(
+                             std::floor(extents[axis] / cellExtent + 0.5)) +
+                         1;
+        strides[axis] = static_cast<uint64_t>(numCells);
+        numCells *= gridSize[axis];
+      }
+      if (numCells < 0x1p62L)
+        break;
+      cellExtent *= 2.;
+    }
+    inverseCellExtent = 1. / cellExtent;
+    // points on a lattice with the spacing of the cells are centered in the
+    // cells, so they are the nearest points of most queries in their cell
+    for (SizeType axis = 0; axis < dim; ++axis)
+      origin[axis] -= cellExtent / 2;
+
+    // twice as many buckets as points, so most buckets only hold the points
+    // of a single cell, or one bucket per cell for small grids
+    numBuckets = 1;
+    isDense = numCells <= maxCellsPerPoint * numPoints;
+    const long double minBuckets = isDense ? numCells : 2 * numPoints;
+    while (numBuckets < minBuckets)
+      numBuckets *= 2;
+
+    std::vector<uint64_t> keys(numPoints);
+    std::vector<SizeType> buckets(numPoints);
+#pragma omp parallel for
+    for (long long i = 0; i < n; ++i) {
+      uint64_t key = 0;
+      for (SizeType axis = 0; axis < dim; ++axis)
+        key += strides[axis] * getCell(coordinates[i * dim + axis], axis);
+      keys[i] = key;
+      buckets[i] = getBucket(key);
+    }
+
+    indices = sortByBucket(buckets, bucketOffsets);
+
+    std::vector<NumericType> sortedCoordinates(coordinates.size());
+    cellKeys.resize(numPoints);
+#pragma omp parallel for
+    for (long long i = 0; i < n; ++i) {
+      for (SizeType axis = 0; axis < dim; ++axis)
+        sortedCoordinates[i * dim + axis] =
+            coordinates[indices[i] * dim + axis];
+      cellKeys[i] = keys[indices[i]];
+    }
+    coordinates.swap(sortedCoordinates);
+
+    isBuilt = true;
+  }
+
+private:
+  // Edge length of cells which hold about one point each, if the points fill
+  // their bounding box.
+  [[nodiscard]] NumericType
+  estimateCellSize(const std::vector<NumericType> &extents) const {
+    NumericType volume = 1.;
+    int numAxes = 0;
+    for (const auto extent : extents) {
+      if (extent > 0.) {
+        volume *= extent;
+        ++numAxes;
+      }
+    }
+    if (numAxes == 0)
+      return 1.;
+    return std::pow(volume / numPoints, NumericType(1) / numAxes);
+  }
+
+  /****************************************************************************
+   * Search                                                                   *
+   ****************************************************************************/
+
+  // Squared distance and position of the closest point.
+  [[nodiscard]] std::pair<NumericType, SizeType>
+  searchNearest(const PointType &x) const {
+    auto best = std::pair{std::numeric_limits<NumericType>::infinity(),
+                          SizeType(0)};
+    traverse(
+        x, [&best]() { return best.first; },
+        [&best](SizeType position, NumericType distance) {
+          if (distance < best.first)
+            best = std::pair{distance, position};
+        },
+        true);
+    return best;
+  }
+
+  void searchKNearest(const PointType &x,
+                      psBoundedPQueue<NumericType, SizeType> &queue) const {
+    traverse(
+        x,
+        [&queue]() {
+          return queue.size() < queue.maxSize()
+                     ? std::numeric_limits<NumericType>::infinity()
+                     : queue.worst();
+        },
+        [&queue](SizeType position, NumericType distance) {
+          queue.enqueue(std::pair{distance, position});
+        },
+        true);
+  }
+
+  // Visits the cells in shells of increasing Chebyshev distance around the
+  // cell of x. All points beyond the distance r are at least r cells plus the
+  // distance of x to the faces of its cell away, so the search stops once
+  // this exceeds bound(). visit(position, squaredDistance) is called for each
+  // point of the visited cells. If approximate is set, the bound is divided
+  // by the approximation factor.
+  template <class BoundFunction, class VisitFunction>
+  void traverse(const PointType &x, BoundFunction exactBound,
+                VisitFunction visit, const bool approximate) const {
+    const SizeType dim = getDimension();
+    const NumericType boundScale = approximate ? 1 / approximationFactor : 1;
+    auto bound = [&exactBound, boundScale]() {
+      return exactBound() * boundScale;
+    };
+    // coordinates of x in units of cells
+    PointType local{};
+    CellType center{}, lower{}, upper{}, cell{};
+    if constexpr (staticDimension == 0) {
+      local.resize(dim);
+      center.resize(dim);
+      lower.resize(dim);
+      upper.resize(dim);
+      cell.resize(dim);
+    }
+
+    // shells closer than firstShell do not intersect the grid, all cells of
+    // the grid are within lastShell
+    long long firstShell = 0;
+    long long lastShell = 0;
+    NumericType faceDistance = 1.;
+    for (SizeType axis = 0; axis < dim; ++axis) {
+      local[axis] = (x[axis] - origin[axis]) * inverseCellExtent;
+      const long long maxCell = gridSize[axis] - 1;
+      // moving a query outside of the grid closer to it only makes the
+      // shells smaller, so the distance bounds stay valid
+      center[axis] = static_cast<long long>(std::floor(
+          std::clamp(local[axis], NumericType(-1), NumericType(maxCell + 1))));
+      firstShell =
+          std::max({firstShell, -center[axis], center[axis] - maxCell});
+      lastShell = std::max({lastShell, center[axis], maxCell - center[axis]});
+
+      const NumericType offset = local[axis] - center[axis];
+      faceDistance = std::min({faceDistance, offset, 1 - offset});
+    }
+    faceDistance = std::max(faceDistance, NumericType(0));
+
+    // the shells (inner, r], the first one includes the cell of x
+    for (long long inner = firstShell - 1, r = std::max(firstShell, 1ll);
+         inner < lastShell; inner = r++) {
+      const NumericType shellDistance = (inner + faceDistance) * cellExtent;
+      if (inner >= 0 && shellDistance * shellDistance > bound())
+        break;
+
+      // the cells of the shell within the grid
+      bool empty = false;
+      uint64_t rowKey = 0;
+      for (SizeType axis = 0; axis < dim; ++axis) {
+        lower[axis] = std::max(center[axis] - r, 0ll);
+        upper[axis] = std::min(center[axis] + r, gridSize[axis] - 1);
+        empty = empty || lower[axis] > upper[axis];
+        cell[axis] = lower[axis];
+        if (axis > 0)
+          rowKey += strides[axis] * lower[axis];
+      }
+      if (empty)
+        continue;
+
+      // the row through the cell of x is visited first, which usually yields
+      // a tight bound for the other rows
+      uint64_t centerKey = 0;
+      bool hasCenterRow = inner < 0;
+      for (SizeType axis = 1; axis < dim; ++axis) {
+        centerKey += strides[axis] * center[axis];
+        hasCenterRow = hasCenterRow && center[axis] >= lower[axis] &&
+                       center[axis] <= upper[axis];
+      }
+      if (hasCenterRow)
+        visitRow(x, local[0], centerKey, lower[0], upper[0], 0., bound, visit);
+
+      while (true) {
+        // squared distance of x to the row in all axes but the first
+        bool onShell = inner < 0;
+        NumericType rowDistance = 0.;
+        for (SizeType axis = 1; axis < dim; ++axis) {
+          onShell = onShell || std::abs(cell[axis] - center[axis]) > inner;
+          const NumericType diff = slabDistance(local[axis], cell[axis]);
+          rowDistance += diff * diff;
+        }
+
+        if (hasCenterRow && rowKey == centerKey) {
+          // already visited
+        } else if (onShell) {
+          visitRow(x, local[0], rowKey, lower[0], upper[0], rowDistance,
+                   bound, visit);
+        } else {
+          // only the two ends of the row are on the shell
+          const long long lowerEnd =
+              std::min(center[0] - inner - 1, upper[0]);
+          const long long upperBegin =
+              std::max(center[0] + inner + 1, lower[0]);
+          if (lower[0] <= lowerEnd)
+            visitRow(x, local[0], rowKey, lower[0], lowerEnd, rowDistance,
+                     bound, visit);
+          if (upperBegin <= upper[0])
+            visitRow(x, local[0], rowKey, upperBegin, upper[0], rowDistance,
+                     bound, visit);
+        }
+
+        // next row of the shell
+        SizeType axis = 1;
+        for (; axis < dim; ++axis) {
+          if (cell[axis] < upper[axis]) {
+            ++cell[axis];
+            rowKey += strides[axis];
+            break;
+          }
+          rowKey -= strides[axis] * (cell[axis] - lower[axis]);
+          cell[axis] = lower[axis];
+        }
+        if (axis == dim)
+          break;
+      }
+    }
+  }
+
+  // Visits the cells [begin, end] of the row along the first axis, which
+  // starts at the linear index rowKey. Their indices are consecutive, so
+  // their points are in at most two ranges of buckets. rowDistance is the
+  // squared distance of x to the row in the other axes in units of cells.
+  template <class BoundFunction, class VisitFunction>
+  void visitRow(const PointType &x, const NumericType localFirst,
+                const uint64_t rowKey, const long long begin,
+                const long long end, NumericType rowDistance,
+                BoundFunction &bound, VisitFunction &visit) const {
+    const NumericType diff = std::max(
+        {begin - localFirst, localFirst - (end + 1), NumericType(0)});
+    rowDistance += diff * diff;
+    if (rowDistance * cellExtent * cellExtent > bound())
+      return;
+
+    const SizeType dim = getDimension();
+    const uint64_t firstKey = rowKey + begin;
+    const uint64_t lastKey = rowKey + end;
+    const uint64_t firstBucket =
+        (getRowBucket(rowKey) + begin) & (numBuckets - 1);
+    const uint64_t endBucket =
+        firstBucket + std::min<uint64_t>(end - begin + 1, numBuckets);
+    for (int part = 0; part < 2; ++part) {
+      // the buckets of the row can wrap around the end of the table
+      const SizeType from = bucketOffsets[part ? 0 : firstBucket];
+      const SizeType to =
+          bucketOffsets[part ? endBucket - numBuckets
+                             : std::min(endBucket, numBuckets)];
+      for (SizeType i = from; i < to; ++i) {
+        if (cellKeys[i] < firstKey || cellKeys[i] > lastKey)
+          continue;
+        NumericType distance = 0.;
+        for (SizeType axis = 0; axis < dim; ++axis) {
+          const NumericType d = coordinates[i * dim + axis] - x[axis];
+          distance += d * d;
+        }
+        visit(i, distance);
+      }
+      if (endBucket <= numBuckets)
+        break;
+    }
+  }
+
+  // Distance of a coordinate to the cell k along an axis, in units of cells.
+  [[nodiscard]] static NumericType slabDistance(const NumericType local,
+                                                const long long k) {
+    return std::max({k - local, local - (k + 1), NumericType(0)});
+  }
+
+  /****************************************************************************
+   * Utility Functions                                                        *
+   ****************************************************************************/
+
+  // Cell of a scaled coordinate along an axis, clamped to the grid.
+  [[nodiscard]] uint64_t getCell(const NumericType value,
+                                 const SizeType axis) const {
+    const auto cell = static_cast<long long>(
+        std::floor((value - origin[axis]) * inverseCellExtent));
+    return std::clamp(cell, 0ll, gridSize[axis] - 1);
+  }
+
+  [[nodiscard]] SizeType getBucket(const uint64_t key) const {
+    const uint64_t first = key % gridSize[0];
+    return (getRowBucket(key - first) + first) & (numBuckets - 1);
+  }
+
+  // Bucket of the first cell of a row, before wrapping it around the table.
+  // The rows are scattered by Fibonacci hashing, since the rows of nearby
+  // cells have regularly spaced indices, which collide easily.
+  [[nodiscard]] uint64_t getRowBucket(const uint64_t rowKey) const {
+    return isDense ? rowKey : (rowKey * 0x9E3779B97F4A7C15ull) >> 32;
+  }
+
+  // Order of the queries sorted by the bucket which contains them.
+  [[nodiscard]] std::vector<SizeType>
+  getQueryOrder(const ValueType *queries, const SizeType numQueries) const {
+    std::vector<SizeType> buckets(numQueries);
+    const long long count = numQueries;
+#pragma omp parallel for
+    for (long long i = 0; i < count; ++i) {
+      uint64_t key = 0;
+      for (SizeType axis = 0; axis < getDimension(); ++axis)
+        key += strides[axis] *
+               getCell(scalingFactors[axis] * queries[i][axis], axis);
+      buckets[i] = getBucket(key);
+    }
+
+    // the counting sort is only worth it if there are enough queries
+    if (numQueries * 4 >= numBuckets) {
+      std::vector<SizeType> offsets;
+      return sortByBucket(buckets, offsets);
+    }
+
+    std::vector<SizeType> order(numQueries);
+    for (SizeType i = 0; i < numQueries; ++i)
+      order[i] = i;
+    std::sort(order.begin(), order.end(), [&buckets](SizeType a, SizeType b) {
+      return buckets[a] < buckets[b];
+    });
+    return order;
+  }
+
+  // Stable counting sort by the bucket of each item. Returns the order of the
+  // items and sets offsets to the first item of each bucket.
+  [[nodiscard]] std::vector<SizeType>
+  sortByBucket(const std::vector<SizeType> &buckets,
+               std::vector<SizeType> &offsets) const {
+    offsets.assign(numBuckets + 1, 0);
+    for (const auto bucket : buckets)
+      ++offsets[bucket + 1];
+    for (SizeType b = 0; b < numBuckets; ++b)
+      offsets[b + 1] += offsets[b];
+
+    std::vector<SizeType> order(buckets.size());
+    std::vector<SizeType> next(offsets.begin(), offsets.end() - 1);
+    for (SizeType i = 0; i < buckets.size(); ++i)
+      order[next[buckets[i]]++] = i;
+    return order;
+  }
+
+  [[nodiscard]] PointType scalePoint(const ValueType &x) const {
+    PointType point{};
+    if constexpr (staticDimension == 0)
+      point.resize(D);
+    for (SizeType axis = 0; axis < getDimension(); ++axis)
+      point[axis] = scalingFactors[axis] * x[axis];
+    return point;
+  }
+
+  // Empties the queue into a vector of indices and distances, the closest
+  // point first.
+  template <class Q>
+  [[nodiscard]] std::vector<std::pair<SizeType, NumericType>>
+  toResult(Q &queue) const {
+    auto result = std::vector<std::pair<SizeType, NumericType>>();
+    result.reserve(queue.size());
+
+    while (!queue.empty()) {
+      const NumericType distance = queue.best();
+      const auto position = queue.dequeueBest();
+      result.emplace_back(indices[position], std::sqrt(distance));
+    }
+    return result;
+  }
+};
+
+#endif
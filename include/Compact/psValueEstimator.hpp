@@ -6,6 +6,7 @@
 #include <vector>
 
 #include <psDataSource.hpp>
+#include <psDataTable.hpp>
 #include <psSmartPointer.hpp>
 
 template <typename NumericType, typename... FeedbackType>
@@ -14,8 +15,8 @@ public:
   using SizeType = size_t;
   using ItemType = std::vector<NumericType>;
   using VectorType = std::vector<ItemType>;
-  using VectorPtr = psSmartPointer<std::vector<ItemType>>;
-  using ConstPtr = psSmartPointer<const std::vector<ItemType>>;
+  using TableType = psDataTable<NumericType>;
+  using ConstPtr = psSmartPointer<const TableType>;
 
 protected:
   SizeType inputDim{0};
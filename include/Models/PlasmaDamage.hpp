@@ -118,7 +118,8 @@ public:
       if (tmp > displacementEnergyThreshold) {
         particleStack.emplace_back(
             csVolumeParticle<T>{particle.position, direction, tmp, 0.,
-                                particle.cellId, particle.scattered - 1});
+                                particle.cellId, particle.scattered - 1,
+                                particle.weight});
       }
 
       // energy transferred to atom (damage)
@@ -137,6 +138,11 @@ public:
     return fill;
   }
 
+  // The damage caused by an ion grows about linearly with its energy.
+  T getImportance(const csVolumeParticle<T> &particle) const override final {
+    return particle.energy / meanIonEnergy;
+  }
+
   T getSourceDistributionPower() const override final { return 1000.; }
   csPair<T> getMeanFreePath() const override final {
     return {meanFreePath, meanFreePath / T(2)};
@@ -184,6 +190,7 @@ template <typename NumericType, int D>
 class DamageModel : public psAdvectionCallback<NumericType, D> {
 protected:
   using psAdvectionCallback<NumericType, D>::domain;
+  using psAdvectionCallback<NumericType, D>::diskMesh;
   csTracing<NumericType, D> tracer;
 
 public:
@@ -201,6 +208,14 @@ public:
     assert(domain->getUseCellSet());
 
     tracer.setCellSet(domain->getCellSet());
+    // Reuse the surface mesh psProcess already extracted in this step. If a
+    // material map is used, the material IDs of that mesh do not correspond
+    // to the level set indices, so the surface is extracted again in this
+    // case. Otherwise a mesh of a previous process must not be used.
+    if (diskMesh && !domain->getMaterialMap())
+      tracer.setDiskMesh(diskMesh);
+    else
+      tracer.setDiskMesh(nullptr);
     tracer.apply();
     return true;
   }
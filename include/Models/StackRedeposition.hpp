@@ -1,12 +1,14 @@
 #pragma once
 
 #include <csDenseCellSet.hpp>
+#include <csStencil.hpp>
 
 #include <lsAdvect.hpp>
 #include <lsToDiskMesh.hpp>
 
 #include <psAdvectionCallback.hpp>
 #include <psDomain.hpp>
+#include <psKDTree.hpp>
 #include <psProcessModel.hpp>
 
 // The selective etching model works in accordance with the geometry generated
@@ -47,10 +49,9 @@ class RedepositionVelocityField : public lsVelocityField<NumericType> {
 public:
   RedepositionVelocityField(
       const std::vector<NumericType> &passedVelocities,
-      const std::vector<std::array<NumericType, 3>> &points)
-      : velocities(passedVelocities), kdTree(points) {
-    assert(points.size() == passedVelocities.size());
-    kdTree.build();
+      const psKDTree<NumericType, std::array<NumericType, 3>> &passedKdTree)
+      : velocities(passedVelocities), kdTree(passedKdTree) {
+    assert(kdTree.size() == passedVelocities.size());
   }
 
   NumericType getScalarVelocity(const std::array<NumericType, 3> &coordinate,
@@ -64,7 +65,7 @@ public:
 
 private:
   const std::vector<NumericType> &velocities;
-  psKDTree<NumericType, std::array<NumericType, 3>> kdTree;
+  const psKDTree<NumericType, std::array<NumericType, 3>> &kdTree;
 };
 
 template <class T, int D>
@@ -82,9 +83,15 @@ class ByproductDynamics : public psAdvectionCallback<T, D> {
   const T redepositionFactor;
   const T redepositionThreshold = 0.1;
   const T redepoTimeInt = 60;
+  // maximum fraction of a cell the byproducts are convected per time step
+  const T convectionCFL = 0.5;
   std::vector<std::array<T, 3>> nodes;
+  // kept between redeposition steps, so it only has to be refitted
+  psKDTree<T, std::array<T, 3>> kdTree;
   T prevProcTime = 0.;
   unsigned counter = 0;
+  // the redeposition advection can move the surface by several grid cells
+  bool redeposited = false;
 
 public:
   ByproductDynamics(const T passedDiffCoeff, const T passedSink,
@@ -134,7 +141,7 @@ public:
       const auto numPoints = points.size();
       std::vector<T> depoRate(numPoints, 0.);
       auto ff = cellSet->getScalarData("byproductSum");
-      auto cellMatIds = cellSet->getScalarData("Material");
+      const auto &cellMatIds = cellSet->getMaterialIds();
 
       for (size_t i = 0; i < numPoints; ++i) {
         int matId = static_cast<int>(materialIds->at(i));
@@ -152,12 +159,12 @@ public:
           int n = 0;
           if (cellIdx == -1)
             continue;
-          if (cellMatIds->at(cellIdx) == plasmaMaterial) {
+          if (cellMatIds[cellIdx] == plasmaMaterial) {
             depoRate[i] = ff->at(cellIdx);
             n++;
           }
           for (const auto ni : cellSet->getNeighbors(cellIdx)) {
-            if (ni != -1 && cellMatIds->at(ni) == plasmaMaterial) {
+            if (ni != -1 && cellMatIds[ni] == plasmaMaterial) {
               depoRate[i] += ff->at(ni);
               n++;
             }
@@ -176,14 +183,16 @@ public:
       }
 
       // advect surface
+      kdTree.updatePoints(points);
       auto redepVelField =
-          psSmartPointer<RedepositionVelocityField<T>>::New(depoRate, points);
+          psSmartPointer<RedepositionVelocityField<T>>::New(depoRate, kdTree);
 
       lsAdvect<T, D> advectionKernel;
       advectionKernel.insertNextLevelSet(domain->getLevelSets()->back());
       advectionKernel.setVelocityField(redepVelField);
       advectionKernel.setAdvectionTime(processTime - prevProcTime);
       advectionKernel.apply();
+      redeposited = true;
 
       prevProcTime = processTime;
       counter++;
@@ -194,7 +203,8 @@ public:
 
   bool applyPostAdvect(const T advectedTime) override {
     auto &cellSet = domain->getCellSet();
-    cellSet->updateMaterials();
+    cellSet->updateMaterials(redeposited);
+    redeposited = false;
     const auto gridDelta = cellSet->getGridDelta();
 
     // add byproducs
@@ -212,89 +222,122 @@ private:
   void diffuseByproducts(psSmartPointer<csDenseCellSet<T, D>> cellSet,
                          const T timeStep) {
     auto data = cellSet->getFillingFractions();
-    auto materialIds = cellSet->getScalarData("Material");
-    auto elems = cellSet->getElements();
-    auto nodes = cellSet->getNodes();
+    const auto &materialIds = cellSet->getMaterialIds();
+    const auto &elems = cellSet->getElements();
+    const auto &nodes = cellSet->getNodes();
     const auto gridDelta = cellSet->getGridDelta();
-    // calculate time discretization
-    const T dt =
+    const long long numCells = data->size();
+    auto isTopCell = [&](size_t e) {
+      return nodes[elems[e][0]][1] + gridDelta / 2. > top - gridDelta;
+    };
+
+    // The sink strength is the amount removed per step of the former
+    // explicit scheme, it is converted to a rate.
+    const T explicitDt =
         std::min(gridDelta * gridDelta / diffusionCoefficient * 0.245, 1.);
-    const int numSteps = static_cast<int>(timeStep / dt);
+
+    // The diffusion is solved implicitly, so the time step is only limited
+    // by the convection and the sink.
+    const T maxStreamVel =
+        std::max(std::abs(holeStreamVel), std::abs(scallopStreamVel));
+    T dt = timeStep;
+    if (maxStreamVel > 0.)
+      dt = std::min(dt, convectionCFL * gridDelta / maxStreamVel);
+    // The sink empties a top cell at most once per step and the diffusion
+    // refills it in between, so the amount removed per step should not
+    // exceed the content of the top cells. The steps are never shorter than
+    // the ones of the explicit scheme.
+    if (sink > 0.) {
+      T topContent = 0.;
+      long long numTopCells = 0;
+#pragma omp parallel for reduction(+ : topContent, numTopCells)
+      for (long long e = 0; e < numCells; e++) {
+        if (materialIds[e] == plasmaMaterial && isTopCell(e)) {
+          topContent += data->at(e);
+          numTopCells++;
+        }
+      }
+      if (numTopCells > 0) {
+        topContent /= numTopCells;
+        dt = std::min(dt, std::max(explicitDt, topContent / sink * explicitDt));
+      }
+    }
+    const int numSteps =
+        (timeStep > 0.) ? static_cast<int>(std::ceil(timeStep / dt)) : 0;
+    if (numSteps == 0)
+      return;
+    dt = timeStep / numSteps;
+
     const T C = dt * diffusionCoefficient / (gridDelta * gridDelta);
     const T holeC = dt / gridDelta * holeStreamVel;
     const T scallopC = dt / gridDelta * scallopStreamVel;
+    const T sinkC = sink * dt / explicitDt;
 
-    for (int ts = 0; ts < numSteps; ts++) {
-      std::vector<T> solution(data->size(), 0.);
-
+    // byproducts only exist in the plasma
 #pragma omp parallel for
-      for (int e = 0; e < data->size(); e++) {
-        if (materialIds->at(e) != plasmaMaterial) {
-          continue;
-        }
+    for (long long e = 0; e < numCells; e++) {
+      if (materialIds[e] != plasmaMaterial)
+        data->at(e) = 0.;
+    }
 
-        int numNeighbors = 0;
-        auto coord = nodes[elems[e][0]];
-        for (int i = 0; i < D; i++) {
-          coord[i] += gridDelta / 2.;
-        }
+    csStencil<T, D> stencil(cellSet);
+    stencil.setMaterialMask(plasmaMaterial);
 
-        auto cellNeighbors = cellSet->getNeighbors(e);
-        for (const auto &n : cellNeighbors) {
-          if (n == -1 || materialIds->at(n) != plasmaMaterial)
-            continue;
+    // sink and convection, split from the diffusion
+    auto kernel = [&](size_t e, const std::vector<T> &values,
+                      const std::array<csIndexType, 2 * D> &cellNeighbors) {
+      auto coord = nodes[elems[e][0]];
+      for (int i = 0; i < D; i++) {
+        coord[i] += gridDelta / 2.;
+      }
 
-          solution[e] += data->at(n);
-          numNeighbors++;
-        }
+      T solution = values[e];
 
-        // diffusion
-        solution[e] =
-            data->at(e) +
-            C * (solution[e] - static_cast<T>(numNeighbors) * data->at(e));
+      // sink at the top
+      if (isTopCell(e)) {
+        return std::max<T>(solution - sinkC, 0.);
+      }
 
-        // sink at the top
-        if (coord[1] > top - gridDelta) {
-          solution[e] = std::max(solution[e] - sink, 0.);
-          continue;
+      // convection
+      if (std::abs(coord[0]) < holeRadius) {
+        // in hole
+        assert(cellSet->getNeighbors(e)[2] != -1 &&
+               "holeStream up neighbor wrong");
+        if (cellNeighbors[2] != -1) {
+          solution -= holeC * (((coord[1] - gridDelta) / top) *
+                                   values[cellNeighbors[2]] -
+                               (coord[1] / top) * values[e]);
         }
-
-        // convection
-        if (std::abs(coord[0]) < holeRadius) {
-          // in hole
-          assert(cellNeighbors[2] != -1 && "holeStream up neighbor wrong");
-          if (materialIds->at(cellNeighbors[2]) == plasmaMaterial) {
-            solution[e] -= holeC * (((coord[1] - gridDelta) / top) *
-                                        data->at(cellNeighbors[2]) -
-                                    (coord[1] / top) * data->at(e));
+      } else {
+        if (coord[0] < 0) {
+          // left side scallop - use forward difference
+          assert(cellSet->getNeighbors(e)[1] != -1 &&
+                 "scallopStream right neighbor wrong");
+          if (cellNeighbors[1] != -1) {
+            solution -= scallopC * (values[cellNeighbors[1]] - values[e]);
           }
         } else {
-          if (coord[0] < 0) {
-            // left side scallop - use forward difference
-            assert(cellNeighbors[1] != -1 &&
-                   "scallopStream right neighbor wrong");
-            if (materialIds->at(cellNeighbors[1]) == plasmaMaterial) {
-              solution[e] -=
-                  scallopC * (data->at(cellNeighbors[1]) - data->at(e));
-            }
-          } else {
-            // right side scallop - use backward difference
-            assert(cellNeighbors[0] != -1 &&
-                   "scallopStream left neighbor wrong");
-            if (materialIds->at(cellNeighbors[0]) == plasmaMaterial) {
-              solution[e] +=
-                  scallopC * (data->at(e) - data->at(cellNeighbors[0]));
-            }
+          // right side scallop - use backward difference
+          assert(cellSet->getNeighbors(e)[0] != -1 &&
+                 "scallopStream left neighbor wrong");
+          if (cellNeighbors[0] != -1) {
+            solution += scallopC * (values[e] - values[cellNeighbors[0]]);
           }
         }
       }
-      *data = std::move(solution);
+      return solution;
+    };
+
+    for (int ts = 0; ts < numSteps; ts++) {
+      stencil.implicitLaplacian(*data, C);
+      stencil.apply(*data, kernel);
     }
+
     auto sum = cellSet->getScalarData("byproductSum");
 
 #pragma omp parallel for shared(sum)
     for (int e = 0; e < data->size(); e++) {
-      if (materialIds->at(e) != plasmaMaterial) {
+      if (materialIds[e] != plasmaMaterial) {
         continue;
       }
 
@@ -1,18 +1,28 @@
 #ifndef PS_ADVECTION_CALLBACK
 #define PS_ADVECTION_CALLBACK
 
+#include <lsMesh.hpp>
+
 #include <psDomain.hpp>
 #include <psSmartPointer.hpp>
 
 template <typename NumericType, int D> class psAdvectionCallback {
 protected:
   psSmartPointer<psDomain<NumericType, D>> domain = nullptr;
+  // Disk mesh of the domain surface, which is kept up to date by psProcess.
+  // It holds the mesh of the current surface when applyPreAdvect is called
+  // and can be used to avoid extracting the surface again in the callback.
+  psSmartPointer<lsMesh<NumericType>> diskMesh = nullptr;
 
 public:
   void setDomain(psSmartPointer<psDomain<NumericType, D>> passedDomain) {
     domain = passedDomain;
   }
 
+  void setDiskMesh(psSmartPointer<lsMesh<NumericType>> passedDiskMesh) {
+    diskMesh = passedDiskMesh;
+  }
+
   virtual bool applyPreAdvect(const NumericType processTime) { return true; }
 
   virtual bool applyPostAdvect(const NumericType advectionTime) { return true; }
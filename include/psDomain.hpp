@@ -129,14 +129,18 @@ public:
 
   materialMapType getMaterialMap() const { return materialMap; }
 
+  // Generate the cell set down to the given depth. If narrowBandWidth is
+  // larger than 0, only cells within this distance of the surface are created.
   void generateCellSet(const NumericType depth = 0.,
-                       const bool passedCellSetPosition = false) {
+                       const bool passedCellSetPosition = false,
+                       const NumericType narrowBandWidth = 0.) {
     useCellSet = true;
     cellSetDepth = depth;
     if (cellSet == nullptr) {
       cellSet = csDomainType::New();
     }
     cellSet->setCellSetPosition(passedCellSetPosition);
+    cellSet->setNarrowBandWidth(narrowBandWidth);
     cellSet->fromLevelSets(levelSets, cellSetDepth);
   }
 
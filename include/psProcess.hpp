@@ -91,6 +91,7 @@ public:
       // apply only advection callback
       if (model->getAdvectionCallback()) {
         model->getAdvectionCallback()->setDomain(domain);
+        model->getAdvectionCallback()->setDiskMesh(nullptr);
         model->getAdvectionCallback()->applyPreAdvect(0);
       } else {
         psLogger::getInstance()
@@ -170,6 +171,7 @@ public:
     const bool useAdvectionCallback = model->getAdvectionCallback() != nullptr;
     if (useAdvectionCallback) {
       model->getAdvectionCallback()->setDomain(domain);
+      model->getAdvectionCallback()->setDiskMesh(diskMesh);
     }
 
     // Determine whether there are process parameters used in ray tracing
@@ -370,8 +372,12 @@ public:
       auto velocitites = model->getSurfaceModel()->calculateVelocities(
           Rates, points, materialIds);
       model->getVelocityField()->setVelocities(velocitites);
-      if (model->getVelocityField()->getTranslationFieldOptions() == 2)
+      const int translationFieldOptions =
+          model->getVelocityField()->getTranslationFieldOptions();
+      if (translationFieldOptions == 2)
         transField->buildKdTree(points);
+      else if (translationFieldOptions == 3)
+        transField->buildSpatialHash(points, gridDelta);
 
       // print debug output
       if (psLogger::getLogLevel() >= 4) {
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+
+#include <embree3/rtcore.h>
+
+#include <psLogger.hpp>
+
+/// Process-wide registry of the Embree device used by the ViennaPS tracers.
+/// All tracers which acquire their device here share one Embree device and
+/// thus one internal thread pool, instead of initializing a new device each
+/// time a tracer is constructed. The device configuration has to be set before
+/// the first tracer is created. If it is changed afterwards, the device is
+/// recreated for all tracers constructed from then on.
+class psRayDevice {
+  RTCDevice device = nullptr;
+  std::mutex deviceMutex;
+
+  // 0 lets Embree use all available hardware threads
+  unsigned numThreads = 0;
+  bool threadAffinity = false;
+  bool hugePages = true;
+
+  psRayDevice() {}
+
+  ~psRayDevice() {
+    if (device)
+      rtcReleaseDevice(device);
+  }
+
+public:
+  psRayDevice(const psRayDevice &) = delete;
+  void operator=(const psRayDevice &) = delete;
+
+  static psRayDevice &getInstance() {
+    static psRayDevice instance;
+    return instance;
+  }
+
+  // Set the number of threads Embree uses for building its acceleration
+  // structures. 0 means all hardware threads are used.
+  void setNumberOfThreads(const unsigned passedNumThreads) {
+    std::lock_guard<std::mutex> lock(deviceMutex);
+    numThreads = passedNumThreads;
+    releaseDevice();
+  }
+
+  // Pin the Embree worker threads to hardware threads. This is beneficial if
+  // the OpenMP threads of the tracers are pinned as well (OMP_PROC_BIND).
+  void setThreadAffinity(const bool passedThreadAffinity) {
+    std::lock_guard<std::mutex> lock(deviceMutex);
+    threadAffinity = passedThreadAffinity;
+    releaseDevice();
+  }
+
+  void setHugePages(const bool passedHugePages) {
+    std::lock_guard<std::mutex> lock(deviceMutex);
+    hugePages = passedHugePages;
+    releaseDevice();
+  }
+
+  // Returns the shared device. The caller holds a reference to the device and
+  // has to release it with rtcReleaseDevice once it is no longer needed.
+  RTCDevice acquire() {
+    std::lock_guard<std::mutex> lock(deviceMutex);
+    if (device == nullptr) {
+      device = rtcNewDevice(getConfig().c_str());
+      if (device == nullptr) {
+        psLogger::getInstance()
+            .addError("Could not create Embree device with config '" +
+                      getConfig() + "'.")
+            .print();
+      }
+    }
+    rtcRetainDevice(device);
+    return device;
+  }
+
+  // Drop the reference the registry holds on the device. The device is
+  // destroyed once all tracers using it have released it as well.
+  void reset() {
+    std::lock_guard<std::mutex> lock(deviceMutex);
+    releaseDevice();
+  }
+
+  std::string getConfig() const {
+    std::string config = hugePages ? "hugepages=1" : "hugepages=0";
+    if (numThreads > 0)
+      config += ",threads=" + std::to_string(numThreads);
+    if (threadAffinity)
+      config += ",set_affinity=1";
+    return config;
+  }
+
+private:
+  void releaseDevice() {
+    if (device) {
+      rtcReleaseDevice(device);
+      device = nullptr;
+    }
+  }
+};
@@ -58,26 +58,27 @@ public:
     transTree.build();
     const auto gridDelta = levelSet->getGrid().getGridDelta();
 
-    std::vector<std::size_t> levelSetPointToMeshIds(
-
-        levelSet->getNumberOfPoints());
-
+    std::vector<std::array<NumericType, 3>> levelSetPointCoordinates(
+        levelSet->getNumberOfPoints(), {0., 0., 0.});
     for (hrleConstSparseIterator<typename lsDomain<NumericType, D>::DomainType>
              it(levelSet->getDomain());
          !it.isFinished(); ++it) {
 
       if (it.isDefined()) {
         auto lsIndicies = it.getStartIndices();
-        std::array<NumericType, 3> levelSetPointCoordinate{0., 0., 0.};
+        assert(it.getPointId() < levelSet->getNumberOfPoints());
+        auto &coordinate = levelSetPointCoordinates[it.getPointId()];
         for (unsigned i = 0; i < D; i++) {
-          levelSetPointCoordinate[i] = lsIndicies[i] * gridDelta;
+          coordinate[i] = lsIndicies[i] * gridDelta;
         }
-        auto meshPointId = transTree.findNearest(levelSetPointCoordinate);
-        assert(it.getPointId() < levelSet->getNumberOfPoints());
-        levelSetPointToMeshIds[it.getPointId()] = meshPointId->first;
       }
     }
 
+    std::vector<std::size_t> levelSetPointToMeshIds;
+    std::vector<NumericType> distances;
+    transTree.findNearestBatch(levelSetPointCoordinates,
+                               levelSetPointToMeshIds, distances);
+
     for (const auto dataName : dataNames) {
       auto pointData = mesh->getCellData().getScalarData(dataName);
       if (!pointData) {
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <lsVelocityField.hpp>
 #include <psKDTree.hpp>
+#include <psSpatialHash.hpp>
 #include <psVelocityField.hpp>
 
 template <typename NumericType>
@@ -49,8 +50,17 @@ public:
   }
 
   void buildKdTree(const std::vector<std::array<NumericType, 3>> &points) {
-    kdTree.setPoints(points);
-    kdTree.build();
+    // the surface points usually change little between time steps, so the
+    // tree is only refitted if their number did not change
+    kdTree.updatePoints(points);
+  }
+
+  // The surface points are spaced about one grid delta apart, so the cells of
+  // the spatial hash have the size of a grid cell.
+  void buildSpatialHash(const std::vector<std::array<NumericType, 3>> &points,
+                        const NumericType gridDelta) {
+    spatialHash.setCellSize(gridDelta);
+    spatialHash.updatePoints(points);
   }
 
   void translateLsId(unsigned long &lsId,
@@ -58,6 +68,9 @@ public:
     if (translationMethod == 2) {
       auto nearest = kdTree.findNearest(coordinate);
       lsId = nearest->first;
+    } else if (translationMethod == 3) {
+      auto nearest = spatialHash.findNearest(coordinate);
+      lsId = nearest->first;
     } else {
       if (auto it = translator->find(lsId); it != translator->end()) {
         lsId = it->second;
@@ -72,6 +85,7 @@ public:
 private:
   psSmartPointer<translatorType> translator;
   psKDTree<NumericType, std::array<NumericType, 3>> kdTree;
+  psSpatialHash<NumericType, std::array<NumericType, 3>> spatialHash;
   const psSmartPointer<psVelocityField<NumericType>> modelVelocityField;
 };
 
@@ -35,6 +35,7 @@ public:
   // 0: do not translate level set ID to surface ID
   // 1: use unordered map to translate level set ID to surface ID
   // 2: use kd-tree to translate level set ID to surface ID
+  // 3: use spatial hash to translate level set ID to surface ID
   virtual int getTranslationFieldOptions() const { return 1; }
 };
 